@@ -1,90 +1,490 @@
 /*
  * mm_alloc.c
+ *
+ * Free blocks are kept in segregated free lists ("bins") by size, so finding
+ * a block for a request never walks the heap. Sizes below SMALL_LIMIT get a
+ * bin each, in steps of ALIGNMENT; larger sizes share SUB_BINS bins per power
+ * of two. A bitmap records which bins are non-empty, so the smallest bin able
+ * to serve a request is found with a few bit scans.
+ *
+ * A block bigger than a request is split, and the rest goes back to a bin.
+ * A freed block is merged with free neighbours on both sides, found in O(1)
+ * through the boundary tags, so no two free blocks are ever adjacent. When
+ * the block at the top of the heap is free and large, it is given back to
+ * the system with a negative sbrk.
+ *
+ * The heap is made of segments of contiguous blocks, each closed by a fence:
+ * a header of an empty block that is never free, which stops merging at the
+ * end of the segment. A new segment starts whenever something else in the
+ * process has moved the break since the last sbrk.
+ *
+ * All of that is the central heap, shared by every thread under heap_mutex.
+ * In front of it, each thread caches free blocks of the small sizes in a
+ * list per size, which it takes from and frees to without any lock. A list
+ * is refilled with a batch of blocks carved from one allocation, and half of
+ * it goes back to the central heap once it grows past twice that, so the
+ * lock is taken once per batch instead of once per call. Cached blocks are
+ * in use as far as the central heap is concerned.
+ *
+ * Requests of MMAP_THRESHOLD bytes and more bypass all of that and get a
+ * mapping of their own, which goes back to the system as soon as they are
+ * freed and which mm_realloc() resizes with mremap() instead of copying.
  */
 
+#define _GNU_SOURCE // For mremap().
+
 #include "mm_alloc.h"
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+
+#define ALIGNMENT 16
+#define SMALL_LIMIT 1024
+#define SMALL_BINS (SMALL_LIMIT / ALIGNMENT)
+#define SUB_BIN_BITS 2
+#define SUB_BINS (1 << SUB_BIN_BITS)
+#define LARGE_MIN_BITS 10 // log2(SMALL_LIMIT)
+#define LARGE_MAX_BITS 48 // Larger blocks all go to the last bin.
+#define NUM_BINS (SMALL_BINS + (LARGE_MAX_BITS - LARGE_MIN_BITS) * SUB_BINS)
+#define BITMAP_WORDS ((NUM_BINS + 63) / 64)
+#define TRIM_THRESHOLD (128 * 1024)
+#define MMAP_THRESHOLD (128 * 1024)
+#define TCACHE_BATCH_BYTES 4096
+#define TCACHE_MAX_BATCH 32
+#define TCACHE_MIN_BATCH 4
 
 void* global_base = NULL;
 
-meta find_free_block(meta base, size_t size)
+static meta bins[NUM_BINS];
+static unsigned long bin_bitmap[BITMAP_WORDS];
+static meta heap_fence; // Fence of the latest segment.
+static pthread_mutex_t heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct tcache {
+  meta lists[SMALL_BINS]; // Linked through next.
+  int counts[SMALL_BINS];
+  int registered;         // Whether the exit destructor is set up.
+  int disabled;           // Set once it has been flushed at thread exit.
+} tcache_t;
+
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static size_t align_size(size_t size) {
+  return (size + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+}
+
+static size_t block_size(meta block) {
+  return block->size & ~(size_t) BLOCK_FLAGS;
+}
+
+static meta next_block(meta block) {
+  return (meta) ((char*) block + META_SIZE + block_size(block));
+}
+
+static meta prev_block(meta block) {
+  return (meta) ((char*) block - block->prev_size - META_SIZE);
+}
+
+/* Bin that a free block of SIZE bytes goes to. */
+static int bin_index(size_t size) {
+  if (size < SMALL_LIMIT) return size / ALIGNMENT;
+  int bits = 63 - __builtin_clzl(size);
+  if (bits >= LARGE_MAX_BITS) return NUM_BINS - 1;
+  return SMALL_BINS + (bits - LARGE_MIN_BITS) * SUB_BINS
+      + ((size >> (bits - SUB_BIN_BITS)) & (SUB_BINS - 1));
+}
+
+/* First bin whose blocks are all at least SIZE bytes: a request is rounded up
+ * to the next bin boundary, so any block found from there on fits. */
+static int bin_index_fitting(size_t size) {
+  if (size < SMALL_LIMIT) return size / ALIGNMENT;
+  int bits = 63 - __builtin_clzl(size);
+  if (bits >= LARGE_MAX_BITS) return NUM_BINS - 1;
+  size_t step = (size_t) 1 << (bits - SUB_BIN_BITS);
+  return bin_index((size + step - 1) & ~(step - 1));
+}
+
+/* First non-empty bin at or after FROM, or -1. */
+static int bin_next_nonempty(int from) {
+  if (from >= NUM_BINS) return -1;
+  int word = from / 64;
+  unsigned long bits = bin_bitmap[word] & (~0UL << (from % 64));
+  while (bits == 0) {
+    if (++word == BITMAP_WORDS) return -1;
+    bits = bin_bitmap[word];
+  }
+  return word * 64 + __builtin_ctzl(bits);
+}
+
+static void bin_insert(meta block) {
+  int index = bin_index(block_size(block));
+  block->prev = NULL;
+  block->next = bins[index];
+  if (bins[index] != NULL) bins[index]->prev = block;
+  bins[index] = block;
+  bin_bitmap[index / 64] |= 1UL << (index % 64);
+}
+
+static void bin_remove(meta block) {
+  int index = bin_index(block_size(block));
+  if (block->prev != NULL) block->prev->next = block->next;
+  else bins[index] = block->next;
+  if (block->next != NULL) block->next->prev = block->prev;
+  if (bins[index] == NULL) bin_bitmap[index / 64] &= ~(1UL << (index % 64));
+}
+
+/* Marks BLOCK, whose size is final, as free: sets its footer in the next
+ * block and puts it in its bin. */
+static void block_set_free(meta block) {
+  block->size |= BLOCK_FREE;
+  meta next = next_block(block);
+  next->prev_size = block_size(block);
+  next->size |= PREV_FREE;
+  bin_insert(block);
+}
+
+/* Takes free BLOCK out of its bin for use. */
+static void block_set_used(meta block) {
+  bin_remove(block);
+  block->size &= ~(size_t) BLOCK_FREE;
+  next_block(block)->size &= ~(size_t) PREV_FREE;
+}
+
+static void heap_free(meta block);
+
+/* Shrinks BLOCK, which is in use, to SIZE bytes if what is left over can
+ * make a block of its own, and frees the rest. */
+static void block_split(meta block, size_t size) {
+  if (block_size(block) < size + META_SIZE + ALIGNMENT) return;
+  meta rest = (meta) ((char*) block + META_SIZE + size);
+  rest->size = block_size(block) - size - META_SIZE;
+  block->size = size | (block->size & BLOCK_FLAGS);
+  heap_free(rest);
+}
+
+/* Gives the free block just below the fence back to the system, if the
+ * fence is at the break, and makes the block the new fence. */
+static int heap_trim(meta block) {
+  if (block_size(block) < TRIM_THRESHOLD || next_block(block) != heap_fence
+      || (char*) heap_fence + META_SIZE != sbrk(0))
+    return -1;
+  if (sbrk(-(intptr_t) (block_size(block) + META_SIZE)) == (void*) -1) return -1;
+  heap_fence = block;
+  block->size = 0;
+  return 0;
+}
+
+/* Returns a free block of at least SIZE bytes, or NULL. Blocks too large for
+ * the last bin's range share it, so only that bin is ever searched. */
+meta find_free_block(size_t size)
 {
-  meta res = NULL;
-  if (base == NULL) {
-    return res;
+  int index = bin_next_nonempty(bin_index_fitting(size));
+  if (index < 0) return NULL;
+  meta block = bins[index];
+  if (index == NUM_BINS - 1) {
+    while (block != NULL && block_size(block) < size) block = block->next;
+  }
+  return block;
+}
+
+/*
+ * Extends the heap to make a block of at least SIZE bytes, which is returned
+ * in use. The latest segment is extended if it still ends at the break, its
+ * top block too if that is free; otherwise a new segment is started. Returns
+ * NULL if sbrk fails.
+ */
+meta request_block(size_t size) {
+  meta block;
+  char* brk = sbrk(0);
+  if (heap_fence != NULL && (char*) heap_fence + META_SIZE == brk) {
+    block = heap_fence;
+    if (block->size & PREV_FREE) block = prev_block(block);
+    char* end = (char*) block + META_SIZE + size + META_SIZE;
+    if (end > brk && sbrk(end - brk) == (void*) -1) return NULL;
+    /* Only claim a free top block once the heap has grown, so that a failed
+     * sbrk leaves it in its bin. */
+    if (block != heap_fence) block_set_used(block);
+    if (end > brk) block->size = size | (block->size & BLOCK_FLAGS);
   } else {
-    while(base != NULL) {
-      if (base->size >= size) {
-        res = base;
-        break;
-      } else {
-        base = base->next;
-      }
-    }
+    size_t padding = -(uintptr_t) brk & (ALIGNMENT - 1);
+    char* start = sbrk(padding + META_SIZE + size + META_SIZE);
+    if (start == (void*) -1) return NULL;
+    block = (meta) (start + padding);
+    block->prev_size = 0;
+    block->size = size;
+    if (global_base == NULL) global_base = block;
   }
-  return res + 1;
+  heap_fence = next_block(block);
+  heap_fence->size = 0;
+  return block;
 }
 
-meta find_tail(meta base) {
-  if (base == NULL) return NULL;
-  while (base->next != NULL) {
-    base = base->next;
+/* Central heap: returns a block of SIZE bytes, a multiple of ALIGNMENT, in
+ * use, or NULL. heap_mutex must be held. */
+static meta heap_malloc(size_t size) {
+  meta block = find_free_block(size);
+  if (block != NULL) {
+    block_set_used(block);
+  } else {
+    block = request_block(size);
+    if (block == NULL) return NULL;
   }
-  return base;
+  block_split(block, size);
+  return block;
 }
 
-meta request_block(size_t size) {
-  meta tail = find_tail(global_base);
-  meta block = sbrk(0);
-  sbrk(size + sizeof(struct meta_data));
-  if (tail != NULL) tail->next = block;
-  block->next = NULL;
+/*
+ * Central heap: grows BLOCK, which is in use, to at least SIZE bytes without
+ * moving it, by taking in the next block if that is free and then, if it
+ * ends up at the break, by extending the heap. Returns -1, having grown it
+ * as far as it could, if that is not enough. heap_mutex must be held.
+ */
+static int heap_grow(meta block, size_t size) {
+  meta next = next_block(block);
+  if (next->size & BLOCK_FREE) {
+    bin_remove(next);
+    block->size += block_size(next) + META_SIZE;
+    next_block(block)->size &= ~(size_t) PREV_FREE;
+  }
+  if (block_size(block) >= size) return 0;
+
+  char* brk = sbrk(0);
+  if (next_block(block) != heap_fence || (char*) heap_fence + META_SIZE != brk) return -1;
+  char* end = (char*) block + META_SIZE + size + META_SIZE;
+  if (sbrk(end - brk) == (void*) -1) return -1;
+  block->size = size | (block->size & BLOCK_FLAGS);
+  heap_fence = next_block(block);
+  heap_fence->size = 0;
+  return 0;
+}
+
+/* Central heap: frees BLOCK, merging it with its free neighbours.
+ * heap_mutex must be held. */
+static void heap_free(meta block) {
+  meta next = next_block(block);
+  size_t size = block_size(block);
+  if (block->size & PREV_FREE) {
+    meta prev = prev_block(block);
+    bin_remove(prev);
+    size += block_size(prev) + META_SIZE;
+    block = prev;
+  }
+  if (next->size & BLOCK_FREE) {
+    bin_remove(next);
+    size += block_size(next) + META_SIZE;
+  }
   block->size = size;
-  block->free = 0;
-  block->prev = tail;
-  return block + 1;
+
+  if (heap_trim(block) < 0) block_set_free(block);
+}
+
+/* Number of blocks of SIZE bytes moved between a thread cache and the central
+ * heap at a time. */
+static int tcache_batch(size_t size) {
+  int batch = TCACHE_BATCH_BYTES / (size + META_SIZE);
+  if (batch < TCACHE_MIN_BATCH) return TCACHE_MIN_BATCH;
+  if (batch > TCACHE_MAX_BATCH) return TCACHE_MAX_BATCH;
+  return batch;
+}
+
+/* Returns COUNT blocks of the central heap to it. */
+static void tcache_flush(int index, int count) {
+  pthread_mutex_lock(&heap_mutex);
+  while (count-- > 0 && tcache.lists[index] != NULL) {
+    meta block = tcache.lists[index];
+    tcache.lists[index] = block->next;
+    tcache.counts[index]--;
+    heap_free(block);
+  }
+  pthread_mutex_unlock(&heap_mutex);
+}
+
+/* Gives everything the exiting thread has cached back to the central heap.
+ * Destructors that run after this one may still allocate and free, so the
+ * cache is turned off for the rest of the thread and small blocks go straight
+ * to the central heap instead of being cached and lost. */
+static void tcache_destroy(void* unused) {
+  tcache.disabled = 1;
+  for (int index = 0; index < SMALL_BINS; index++)
+    tcache_flush(index, tcache.counts[index]);
+}
+
+static void tcache_create_key(void) {
+  pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/* Sets up the exit destructor of this thread's cache, the first time it is
+ * about to hold a block: whether by allocating or only by freeing. */
+static void tcache_register(void) {
+  if (tcache.registered) return;
+  pthread_once(&tcache_key_once, tcache_create_key);
+  pthread_setspecific(tcache_key, &tcache);
+  tcache.registered = 1;
+}
+
+/*
+ * Refills the cache list for blocks of SIZE bytes with a batch of them,
+ * carved out of a single block of the central heap. The last one also gets
+ * whatever the central heap could not split off. Returns -1 if out of memory.
+ */
+static int tcache_refill(int index, size_t size) {
+  tcache_register();
+
+  /* The central heap may set PREV_FREE in the first block, so it is carved
+   * under the lock. */
+  int batch = tcache_batch(size);
+  pthread_mutex_lock(&heap_mutex);
+  meta block = heap_malloc(batch * (size + META_SIZE) - META_SIZE);
+  if (block == NULL) {
+    pthread_mutex_unlock(&heap_mutex);
+    return -1;
+  }
+  size_t left = block_size(block);
+  block->size &= PREV_FREE;
+  for (int i = 0; i < batch; i++) {
+    size_t this_size = i < batch - 1 ? size : left;
+    block->size |= this_size;
+    left -= this_size + META_SIZE;
+    block->next = tcache.lists[index];
+    tcache.lists[index] = block;
+    tcache.counts[index]++;
+    if (i < batch - 1) {
+      block = next_block(block);
+      block->size = 0;
+    }
+  }
+  pthread_mutex_unlock(&heap_mutex);
+  return 0;
+}
+
+/* Size of the mapping holding a block of SIZE bytes. */
+static size_t mapping_length(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return (size + META_SIZE + page - 1) & ~(page - 1);
+}
+
+/* Returns a block of SIZE bytes in a mapping of its own, or NULL. */
+static meta map_block(size_t size) {
+  size_t length = mapping_length(size);
+  meta block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (block == MAP_FAILED) return NULL;
+  block->prev_size = 0;
+  block->size = (length - META_SIZE) | BLOCK_MMAPPED;
+  return block;
 }
 
 void* mm_malloc(size_t size)
 {
-  //TODO: Implement malloc
-  void* res = find_free_block(global_base, size);
-  if (res != NULL) return res;
-  else {
-    res = request_block(size);
-    if (global_base == NULL) {
-      global_base = get_meta_block(res);
-    }
-    return res;
+  if (size == 0 || size > PTRDIFF_MAX) return NULL;
+  size = align_size(size);
+
+  meta block;
+  if (size >= MMAP_THRESHOLD) {
+    block = map_block(size);
+    if (block == NULL) return NULL;
+  } else if (size < SMALL_LIMIT && !tcache.disabled) {
+    int index = bin_index(size);
+    if (tcache.lists[index] == NULL && tcache_refill(index, size) < 0) return NULL;
+    block = tcache.lists[index];
+    tcache.lists[index] = block->next;
+    tcache.counts[index]--;
+  } else {
+    pthread_mutex_lock(&heap_mutex);
+    block = heap_malloc(size);
+    pthread_mutex_unlock(&heap_mutex);
+    if (block == NULL) return NULL;
   }
-  return NULL;
+  return get_real_block(block);
 }
 
 meta get_meta_block(void* position) {
-  return (meta)position - 1;
+  return (meta) ((char*) position - META_SIZE);
 }
 
 void* get_real_block(meta meta_position) {
-  return meta_position + 1;
+  return (char*) meta_position + META_SIZE;
 }
 
+/*
+ * Resizes the block at PTR in place when it can: a mapped block is resized
+ * with mremap(), which moves pages rather than bytes, while a block of the
+ * heap is split, or grown into a free neighbour or past the break. Small
+ * blocks, which belong to the thread cache, and everything else are moved
+ * to a new block, copying only the payload.
+ */
 void* mm_realloc(void* ptr, size_t size)
 {
-  //TODO: Implement realloc
-  void* dest = mm_malloc(size);
-  void* src = get_meta_block(ptr);
-  memcpy(dest, src, size + sizeof(struct meta_data));
+  if (ptr == NULL) return mm_malloc(size);
+  if (size == 0) {
+    mm_free(ptr);
+    return NULL;
+  }
+  if (size > PTRDIFF_MAX) return NULL;
+  size = align_size(size);
+  meta block = get_meta_block(ptr);
+  size_t old_size = block_size(block);
+
+  if (block->size & BLOCK_MMAPPED) {
+    if (size >= MMAP_THRESHOLD) {
+      size_t length = mapping_length(size);
+      meta moved = mremap(block, old_size + META_SIZE, length, MREMAP_MAYMOVE);
+      if (moved == MAP_FAILED) return NULL;
+      moved->size = (length - META_SIZE) | BLOCK_MMAPPED;
+      return get_real_block(moved);
+    }
+  } else if (size <= old_size) {
+    if (old_size >= SMALL_LIMIT) {
+      pthread_mutex_lock(&heap_mutex);
+      block_split(block, size);
+      pthread_mutex_unlock(&heap_mutex);
+    }
+    return ptr;
+  } else if (old_size >= SMALL_LIMIT) {
+    pthread_mutex_lock(&heap_mutex);
+    int grown = heap_grow(block, size) == 0;
+    if (grown) block_split(block, size);
+    old_size = block_size(block);
+    pthread_mutex_unlock(&heap_mutex);
+    if (grown) return ptr;
+  }
+
+  void* moved = mm_malloc(size);
+  if (moved == NULL) return NULL;
+  memcpy(moved, ptr, old_size < size ? old_size : size);
   mm_free(ptr);
-  return NULL;
+  return moved;
 }
 
 void mm_free(void* ptr)
 {
-  //TODO: Implement free
+  if (ptr == NULL) return;
   meta meta_position = get_meta_block(ptr);
-  meta_position -> free = 1;
+
+  /* Only this thread touches the size of a block it holds; the central heap
+   * may set PREV_FREE meanwhile, which block_size() ignores. */
+  size_t size = block_size(meta_position);
+  if (meta_position->size & BLOCK_MMAPPED) {
+    munmap(meta_position, size + META_SIZE);
+    return;
+  }
+  if (size < SMALL_LIMIT && !tcache.disabled) {
+    int index = bin_index(size);
+    tcache_register();
+    meta_position->next = tcache.lists[index];
+    tcache.lists[index] = meta_position;
+    if (++tcache.counts[index] > 2 * tcache_batch(size))
+      tcache_flush(index, tcache_batch(size));
+    return;
+  }
+
+  pthread_mutex_lock(&heap_mutex);
+  heap_free(meta_position);
+  pthread_mutex_unlock(&heap_mutex);
 }
@@ -9,25 +9,37 @@
 #ifndef _malloc_H_
 #define _malloc_H_
 
+#include <stddef.h>
 #include <stdlib.h>
 
 extern void* global_base; // How to ensure every process have unique global block and tail node?
 
+/*
+ * Header of a block. Only prev_size and size precede the payload: the bin
+ * links are kept in the payload while the block is free. prev_size is the
+ * footer of the block just below, a boundary tag that is only kept up to
+ * date while that block is free (PREV_FREE).
+ */
 struct meta_data
 {
-    size_t size;
-    size_t free;
-    struct meta_data *next;
+    size_t prev_size;
+    size_t size;            // Payload size, with the flags in its low bits.
+    struct meta_data *next; // Neighbours in the bin of a free block.
     struct meta_data *prev;
 };
 
+#define META_SIZE offsetof(struct meta_data, next)
+#define BLOCK_FREE 1
+#define PREV_FREE 2
+#define BLOCK_MMAPPED 4
+#define BLOCK_FLAGS 15
+
 typedef struct meta_data* meta;
 
 void* mm_malloc(size_t size);
 void* mm_realloc(void* ptr, size_t size);
 void mm_free(void* ptr);
-meta find_free_block(meta base, size_t size);
-meta find_tail(meta base);
+meta find_free_block(size_t size);
 meta request_block(size_t size);
 meta get_meta_block(void* position);
 void* get_real_block(meta meta_position);
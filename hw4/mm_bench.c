@@ -0,0 +1,433 @@
+/*
+ * mm_bench.c
+ *
+ * Replays allocation traces against the allocator in hw3lib.so, loaded the
+ * same way mm_test does, and against the C library's malloc as a baseline.
+ * Each trace and allocator pair runs in a child process of its own, so every
+ * run starts from an empty heap and gets its own peak RSS.
+ *
+ * For every run it reports the throughput, the peak of the bytes the trace
+ * held live, the peak heap (RSS gained during the run), utilization (peak
+ * live / peak heap) and fragmentation (1 - utilization). Every allocated
+ * block has a byte written in each of its pages, so the heap a run needs
+ * shows up in its RSS.
+ *
+ * Trace files have one operation per line ('#' starts a comment), with IDs
+ * naming blocks:
+ *
+ *     a ID SIZE     malloc
+ *     r ID SIZE     realloc (of a NULL block if ID is not allocated)
+ *     f ID          free
+ *
+ * SIZE must be at least 1; freeing is always written as "f".
+ */
+
+#include <dlfcn.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGE 4096
+
+typedef struct op {
+    char type;      // 'a', 'r' or 'f'.
+    unsigned id;
+    size_t size;
+} op_t;
+
+typedef struct trace {
+    const char* name;
+    op_t* ops;
+    size_t num_ops;
+    unsigned num_ids;
+} trace_t;
+
+typedef struct allocator {
+    const char* name;
+    void* (*malloc)(size_t);
+    void* (*realloc)(void*, size_t);
+    void (*free)(void*);
+} allocator_t;
+
+typedef struct result {
+    int ok;
+    double seconds;
+    size_t peak_live;
+    size_t peak_heap;
+} result_t;
+
+typedef struct replay {
+    trace_t* trace;
+    allocator_t* allocator;
+    void** blocks;
+    size_t* sizes;
+    size_t peak_live;
+    int ok;
+} replay_t;
+
+static int num_threads = 1;
+
+void load_alloc_functions(allocator_t* allocator) {
+    void *handle = dlopen("hw3lib.so", RTLD_NOW);
+    if (!handle) {
+        fprintf(stderr, "%s\n", dlerror());
+        exit(1);
+    }
+
+    const char* names[] = { "mm_malloc", "mm_realloc", "mm_free" };
+    void* functions[3];
+    for (int i = 0; i < 3; i++) {
+        functions[i] = dlsym(handle, names[i]);
+        if (functions[i] == NULL) {
+            fprintf(stderr, "%s\n", dlerror());
+            exit(1);
+        }
+    }
+    allocator->name = "hw3lib";
+    allocator->malloc = functions[0];
+    allocator->realloc = functions[1];
+    allocator->free = functions[2];
+}
+
+/*
+ * Trace building. Traces are built with the C library's malloc before any
+ * run starts.
+ */
+
+static void trace_add(trace_t* trace, size_t* capacity, char type, unsigned id, size_t size) {
+    if (trace->num_ops == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 1024;
+        trace->ops = realloc(trace->ops, *capacity * sizeof(op_t));
+        if (trace->ops == NULL) {
+            fprintf(stderr, "Malloc failed\n");
+            exit(1);
+        }
+    }
+    trace->ops[trace->num_ops++] = (op_t) { type, id, size };
+    if (id >= trace->num_ids) trace->num_ids = id + 1;
+}
+
+/* Size between LOW and HIGH, uniform in its logarithm, as object sizes tend
+ * to be. */
+static size_t log_uniform(unsigned* seed, size_t low, size_t high) {
+    double r = (double) rand_r(seed) / RAND_MAX;
+    return (size_t) (low * pow((double) high / low, r));
+}
+
+/* Random churn: blocks of mixed sizes allocated and freed in random order,
+ * around a steady live set. */
+static void trace_churn(trace_t* trace, size_t num_ops, unsigned seed) {
+    size_t capacity = 0;
+    unsigned slots = 10000;
+    char* live = calloc(slots, 1);
+    trace->name = "churn";
+    while (trace->num_ops < num_ops) {
+        unsigned id = rand_r(&seed) % slots;
+        if (live[id]) {
+            trace_add(trace, &capacity, 'f', id, 0);
+        } else {
+            int r = rand_r(&seed) % 100;
+            size_t size = r < 80 ? log_uniform(&seed, 16, 256)
+                : r < 98 ? log_uniform(&seed, 256, 8192) : log_uniform(&seed, 8192, 512 * 1024);
+            trace_add(trace, &capacity, 'a', id, size);
+        }
+        live[id] = !live[id];
+    }
+    for (unsigned id = 0; id < slots; id++)
+        if (live[id]) trace_add(trace, &capacity, 'f', id, 0);
+    free(live);
+}
+
+/* Producer/consumer: messages are freed in the order they were allocated,
+ * from a queue whose depth wanders, which leaves holes that later messages
+ * of other sizes must fit into. */
+static void trace_fifo(trace_t* trace, size_t num_ops, unsigned seed) {
+    size_t capacity = 0;
+    unsigned head = 0, tail = 0, depth = 5000;
+    trace->name = "fifo";
+    while (trace->num_ops < num_ops) {
+        if (rand_r(&seed) % 1000 == 0)
+            depth = 1000 + rand_r(&seed) % 20000;
+        if (tail - head >= depth) {
+            trace_add(trace, &capacity, 'f', head++ % 32768, 0);
+        } else {
+            trace_add(trace, &capacity, 'a', tail++ % 32768, log_uniform(&seed, 32, 4096));
+        }
+    }
+    while (head != tail) trace_add(trace, &capacity, 'f', head++ % 32768, 0);
+}
+
+/* Realloc growth: buffers appended to a little at a time, as strings and
+ * vectors are, then dropped once they reach a random length. */
+static void trace_realloc(trace_t* trace, size_t num_ops, unsigned seed) {
+    size_t capacity = 0;
+    unsigned buffers = 64;
+    size_t* lengths = calloc(buffers, sizeof(size_t));
+    size_t* limits = calloc(buffers, sizeof(size_t));
+    trace->name = "realloc";
+    while (trace->num_ops < num_ops) {
+        unsigned id = rand_r(&seed) % buffers;
+        if (limits[id] == 0) limits[id] = log_uniform(&seed, 1024, 4 << 20);
+        if (lengths[id] >= limits[id]) {
+            trace_add(trace, &capacity, 'f', id, 0);
+            lengths[id] = limits[id] = 0;
+        } else {
+            lengths[id] += 1 + rand_r(&seed) % 2048;
+            trace_add(trace, &capacity, 'r', id, lengths[id]);
+        }
+    }
+    for (unsigned id = 0; id < buffers; id++)
+        if (lengths[id] > 0) trace_add(trace, &capacity, 'f', id, 0);
+    free(lengths);
+    free(limits);
+}
+
+/* Reads a recorded trace from PATH. */
+static void trace_load(trace_t* trace, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    size_t capacity = 0;
+    char line[256];
+    unsigned line_number = 0;
+    trace->name = path;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char type;
+        unsigned id;
+        size_t size = 0;
+        if (line[0] == '#' || line[0] == '\n') continue;
+        int fields = sscanf(line, " %c %u %zu", &type, &id, &size);
+        if (fields < 2 || (type != 'a' && type != 'r' && type != 'f')
+            || (type != 'f' && (fields < 3 || size == 0))) {
+            fprintf(stderr, "%s:%u: expected \"a ID SIZE\", \"r ID SIZE\" or \"f ID\"\n",
+                path, line_number);
+            exit(1);
+        }
+        trace_add(trace, &capacity, type, id, size);
+    }
+    fclose(file);
+}
+
+/*
+ * Replay.
+ */
+
+/* Writes a byte in every page of BLOCK[FROM..TO), and stamps its first byte
+ * with ID so that a block handed out twice is noticed. */
+static void touch(unsigned char* block, size_t from, size_t to, unsigned id) {
+    for (size_t i = from; i < to; i += PAGE) block[i] = 1;
+    block[0] = (unsigned char) id;
+}
+
+static void* replay_run(void* void_replay) {
+    replay_t* replay = void_replay;
+    trace_t* trace = replay->trace;
+    allocator_t* allocator = replay->allocator;
+    void** blocks = replay->blocks;
+    size_t* sizes = replay->sizes;
+    size_t live = 0;
+
+    for (size_t i = 0; i < trace->num_ops; i++) {
+        op_t* op = &trace->ops[i];
+        unsigned char* block = blocks[op->id];
+        if (block != NULL && block[0] != (unsigned char) op->id) {
+            replay->ok = 0;
+            return NULL;
+        }
+        switch (op->type) {
+        case 'a':
+            allocator->free(block);
+            live -= sizes[op->id];
+            block = allocator->malloc(op->size);
+            if (block == NULL) goto failed;
+            touch(block, 0, op->size, op->id);
+            break;
+        case 'r':
+            block = allocator->realloc(block, op->size);
+            if (block == NULL) goto failed;
+            if (op->size > sizes[op->id])
+                touch(block, sizes[op->id], op->size, op->id);
+            live -= sizes[op->id];
+            break;
+        default:
+            allocator->free(block);
+            live -= sizes[op->id];
+            block = NULL;
+            break;
+        }
+        blocks[op->id] = block;
+        sizes[op->id] = block != NULL ? op->size : 0;
+        live += sizes[op->id];
+        if (live > replay->peak_live) replay->peak_live = live;
+    }
+    return NULL;
+
+failed:
+    replay->ok = 0;
+    return NULL;
+}
+
+static size_t current_rss(void) {
+    long size, resident;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) return 0;
+    if (fscanf(statm, "%ld %ld", &size, &resident) != 2) resident = 0;
+    fclose(statm);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static double now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Replays TRACE against ALLOCATOR in every thread. Runs in the child. */
+static void replay_trace(trace_t* trace, allocator_t* allocator, result_t* result) {
+    replay_t replays[num_threads];
+    pthread_t threads[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        replays[i] = (replay_t) { trace, allocator, NULL, NULL, 0, 1 };
+        replays[i].blocks = calloc(trace->num_ids, sizeof(void*));
+        replays[i].sizes = calloc(trace->num_ids, sizeof(size_t));
+        if (replays[i].blocks == NULL || replays[i].sizes == NULL) return;
+        /* Fault the tables in now, so they do not count as heap. */
+        memset(replays[i].blocks, 0, trace->num_ids * sizeof(void*));
+        memset(replays[i].sizes, 0, trace->num_ids * sizeof(size_t));
+    }
+
+    size_t rss_before = current_rss();
+    double start = now();
+    for (int i = 0; i < num_threads; i++)
+        pthread_create(&threads[i], NULL, replay_run, &replays[i]);
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    result->seconds = now() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    size_t peak_rss = usage.ru_maxrss * 1024;
+    result->peak_heap = peak_rss > rss_before ? peak_rss - rss_before : 0;
+    result->ok = 1;
+    for (int i = 0; i < num_threads; i++) {
+        result->peak_live += replays[i].peak_live;
+        result->ok &= replays[i].ok;
+    }
+}
+
+/* Runs TRACE against ALLOCATOR in a child process and prints the results. */
+static void bench(trace_t* trace, allocator_t* allocator) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        result_t result = { 0 };
+        replay_trace(trace, allocator, &result);
+        if (write(fds[1], &result, sizeof(result)) != sizeof(result)) _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    result_t result = { 0 };
+    ssize_t length = read(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+
+    printf("%-10s %-8s", trace->name, allocator->name);
+    if (length != sizeof(result) || !result.ok) {
+        printf(" FAILED (out of memory, or a block was corrupted)\n");
+        return;
+    }
+    double ops = (double) trace->num_ops * num_threads;
+    double utilization = result.peak_heap ? (double) result.peak_live / result.peak_heap : 0;
+    printf(" %10.0f %12.0f %10.1f %10.1f %8.1f%% %8.1f%%\n", ops, ops / result.seconds,
+        result.peak_live / 1048576.0, result.peak_heap / 1048576.0,
+        100 * utilization, 100 * (1 - utilization));
+}
+
+static void usage(const char* program) {
+    fprintf(stderr,
+        "Usage: %s [--trace FILE | --synthetic churn,fifo,realloc] [--ops 1000000]\n"
+        "          [--threads 1] [--allocator both|hw3lib|glibc] [--seed 1]\n",
+        program);
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    const char* trace_file = NULL;
+    const char* synthetic = "churn,fifo,realloc";
+    const char* which = "both";
+    size_t num_ops = 1000000;
+    unsigned seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 == argc) usage(argv[0]);
+        if (strcmp(argv[i], "--trace") == 0) {
+            trace_file = argv[++i];
+        } else if (strcmp(argv[i], "--synthetic") == 0) {
+            synthetic = argv[++i];
+        } else if (strcmp(argv[i], "--ops") == 0) {
+            num_ops = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--allocator") == 0) {
+            which = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            seed = strtoul(argv[++i], NULL, 10);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (num_ops == 0 || num_threads < 1) usage(argv[0]);
+
+    allocator_t allocators[2];
+    int num_allocators = 0;
+    if (strcmp(which, "glibc") != 0)
+        load_alloc_functions(&allocators[num_allocators++]);
+    if (strcmp(which, "hw3lib") != 0)
+        allocators[num_allocators++] = (allocator_t) { "glibc", malloc, realloc, free };
+
+    trace_t traces[3];
+    int num_traces = 0;
+    if (trace_file != NULL) {
+        memset(&traces[0], 0, sizeof(trace_t));
+        trace_load(&traces[num_traces++], trace_file);
+    } else {
+        char* names = strdup(synthetic);
+        for (char* name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+            if (num_traces == 3) usage(argv[0]);
+            trace_t* trace = &traces[num_traces++];
+            memset(trace, 0, sizeof(trace_t));
+            if (strcmp(name, "churn") == 0) trace_churn(trace, num_ops, seed);
+            else if (strcmp(name, "fifo") == 0) trace_fifo(trace, num_ops, seed);
+            else if (strcmp(name, "realloc") == 0) trace_realloc(trace, num_ops, seed);
+            else usage(argv[0]);
+        }
+    }
+
+    printf("%-10s %-8s %10s %12s %10s %10s %9s %9s\n", "trace", "alloc", "ops", "ops/s",
+        "live_MB", "heap_MB", "util", "frag");
+    fflush(stdout);
+    for (int t = 0; t < num_traces; t++) {
+        for (int a = 0; a < num_allocators; a++) {
+            bench(&traces[t], &allocators[a]);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,212 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "accesslog.h"
+#include "stats.h"
+#include "utlist.h"
+
+#define ACCESSLOG_BUFFER_SIZE (1 << 16)
+
+/* The mutex only guards the list of rings: it is taken when a thread logs
+ * for the first time, when it exits, and by the writer for each batch. */
+static pthread_mutex_t accesslog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t accesslog_wake_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t accesslog_wake;
+static accesslog_ring_t *accesslog_rings;
+static pthread_key_t accesslog_key;
+static __thread accesslog_ring_t *accesslog_self;
+static __thread unsigned int accesslog_seed;
+static FILE *accesslog_file;
+static unsigned int accesslog_threshold; // Sampled if a random draw is below it.
+static int accesslog_everything;
+
+/* Called when a thread that has logged something exits. Its ring is left for
+ * the writer to drain and free. */
+static void accesslog_retire(void *void_self) {
+  accesslog_ring_t *self = void_self;
+  __atomic_store_n(&self->retired, 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the calling thread's ring, creating it on first use. */
+static accesslog_ring_t *accesslog_local(void) {
+  if (accesslog_self != NULL) return accesslog_self;
+
+  accesslog_ring_t *self = calloc(1, sizeof(accesslog_ring_t));
+  if (self == NULL) {
+    fprintf(stderr, "Malloc failed\n");
+    exit(ENOBUFS);
+  }
+  pthread_mutex_lock(&accesslog_mutex);
+  DL_APPEND(accesslog_rings, self);
+  pthread_mutex_unlock(&accesslog_mutex);
+  pthread_setspecific(accesslog_key, self);
+  accesslog_self = self;
+  return self;
+}
+
+/* Whether the request that was just read should be logged. Sampling uses a
+ * xorshift generator per thread, so that it needs no shared state. */
+int accesslog_sample(void) {
+  if (accesslog_file == NULL) return 0;
+  if (accesslog_everything) return 1;
+  unsigned int x = accesslog_seed;
+  if (x == 0) x = ((unsigned int) (unsigned long) &accesslog_seed ^ (unsigned int) time(NULL)) | 1;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  accesslog_seed = x;
+  return x < accesslog_threshold;
+}
+
+/* Hands a copy of ENTRY to the writer, or drops it if the calling thread's
+ * ring is full. */
+void accesslog_write(accesslog_entry_t *entry) {
+  accesslog_ring_t *self = accesslog_local();
+  unsigned long tail = self->tail;
+  if (tail - __atomic_load_n(&self->head, __ATOMIC_ACQUIRE) >= ACCESSLOG_RING_SIZE) {
+    stats_count(STATS_LOG_DROPPED);
+    return;
+  }
+  self->entries[tail & (ACCESSLOG_RING_SIZE - 1)] = *entry;
+  __atomic_store_n(&self->tail, tail + 1, __ATOMIC_RELEASE);
+  /* Under heavy load the writer has to come sooner than its timer. A wakeup
+   * that is missed because the writer is busy only delays it until then. */
+  if (tail + 1 - self->head == ACCESSLOG_RING_SIZE / 2)
+    pthread_cond_signal(&accesslog_wake);
+}
+
+/* Writes STRING as a JSON string. */
+static void accesslog_quote(FILE *out, const char *string) {
+  putc('"', out);
+  for (const unsigned char *s = (const unsigned char *) string; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(out, "\\%c", *s);
+    else if (*s < 0x20 || *s == 0x7f)
+      fprintf(out, "\\u%04x", *s);
+    else
+      putc(*s, out);
+  }
+  putc('"', out);
+}
+
+static void accesslog_format(FILE *out, accesslog_entry_t *entry) {
+  time_t seconds = entry->time_us / 1000000;
+  struct tm tm;
+  gmtime_r(&seconds, &tm);
+  char when[32];
+  strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+  struct in_addr addr = { .s_addr = entry->addr };
+  char client[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &addr, client, sizeof(client));
+
+  fprintf(out, "{\"time\":\"%s.%03ldZ\",\"client\":\"%s:%d\",\"method\":", when,
+      entry->time_us / 1000 % 1000, client, ntohs(entry->port));
+  accesslog_quote(out, entry->method);
+  fprintf(out, ",\"path\":");
+  accesslog_quote(out, entry->path);
+  fprintf(out, ",\"status\":%d,\"bytes\":%ld,\"duration_us\":%ld}\n",
+      entry->status, entry->bytes, entry->duration_us);
+}
+
+/* Formats the entries RING holds. Called with the mutex held. */
+static void accesslog_drain_ring(accesslog_ring_t *ring) {
+  unsigned long head = ring->head;
+  unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++)
+    accesslog_format(accesslog_file, &ring->entries[head & (ACCESSLOG_RING_SIZE - 1)]);
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+/* Writes out every entry the rings hold, freeing the rings of threads that
+ * have exited once they are empty. The file is flushed before the mutex is
+ * released, so that a fork() (see accesslog_flush()) never copies half a
+ * batch into the child's buffer. */
+static void accesslog_drain(void) {
+  pthread_mutex_lock(&accesslog_mutex);
+  accesslog_ring_t *ring, *tmp;
+  DL_FOREACH_SAFE(accesslog_rings, ring, tmp) {
+    int retired = __atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE);
+    accesslog_drain_ring(ring);
+    if (retired) {
+      DL_DELETE(accesslog_rings, ring);
+      free(ring);
+    }
+  }
+  fflush(accesslog_file);
+  pthread_mutex_unlock(&accesslog_mutex);
+}
+
+/*
+ * Writes out the calling thread's entries right away. Used by processes that
+ * exit without a writer thread of their own, like the FORKSERVER's children:
+ * the rings of other threads that a child inherited are left alone, since
+ * the parent writes those.
+ */
+void accesslog_flush(void) {
+  if (accesslog_file == NULL || accesslog_self == NULL) return;
+  pthread_mutex_lock(&accesslog_mutex);
+  accesslog_drain_ring(accesslog_self);
+  fflush(accesslog_file);
+  pthread_mutex_unlock(&accesslog_mutex);
+}
+
+/* Keeps fork() from happening halfway through a batch, which would leave the
+ * child with a locked mutex and a copy of the unflushed part. */
+static void accesslog_fork_prepare(void) {
+  pthread_mutex_lock(&accesslog_mutex);
+}
+
+static void accesslog_fork_done(void) {
+  pthread_mutex_unlock(&accesslog_mutex);
+}
+
+static void *accesslog_writer(void *unused) {
+  pthread_detach(pthread_self());
+  while (1) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += ACCESSLOG_FLUSH_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&accesslog_wake_mutex);
+    pthread_cond_timedwait(&accesslog_wake, &accesslog_wake_mutex, &deadline);
+    pthread_mutex_unlock(&accesslog_wake_mutex);
+    accesslog_drain();
+  }
+  return NULL;
+}
+
+/*
+ * Starts logging a SAMPLE_RATE fraction of requests to the file at PATH
+ * (appended to), or to stdout if PATH is "-". Returns -1, with errno set, if
+ * the file cannot be opened.
+ */
+int accesslog_open(const char *path, double sample_rate) {
+  FILE *file = strcmp(path, "-") == 0 ? stdout : fopen(path, "a");
+  if (file == NULL) return -1;
+  setvbuf(file, NULL, _IOFBF, ACCESSLOG_BUFFER_SIZE);
+  pthread_key_create(&accesslog_key, accesslog_retire);
+  pthread_atfork(accesslog_fork_prepare, accesslog_fork_done, accesslog_fork_done);
+  pthread_condattr_t condattr;
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&accesslog_wake, &condattr);
+  pthread_condattr_destroy(&condattr);
+  accesslog_everything = sample_rate >= 1;
+  accesslog_threshold = sample_rate > 0 ? (unsigned int) (sample_rate * 4294967296.0) : 0;
+  accesslog_file = file;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, accesslog_writer, NULL) != 0) {
+    accesslog_file = NULL;
+    return -1;
+  }
+  return 0;
+}
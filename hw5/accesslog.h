@@ -0,0 +1,46 @@
+#ifndef __ACCESSLOG__
+#define __ACCESSLOG__
+
+/* ACCESSLOG writes a line of JSON for every request served (or a sampled
+ * fraction of them) to a log file, without ever making a worker wait on the
+ * file. Each thread hands its entries to a ring of its own, which only it
+ * fills and only the writer thread drains, so logging takes no locks and no
+ * system calls. The writer wakes every ACCESSLOG_FLUSH_MS, or as soon as a
+ * ring is half full, and writes out everything the rings hold in one batch. A
+ * ring that fills up before the writer gets to it drops new entries, which
+ * are counted as log_dropped in the server's stats. */
+
+#define ACCESSLOG_RING_SIZE 1024 // Entries per thread; must be a power of two.
+#define ACCESSLOG_FLUSH_MS 100
+#define ACCESSLOG_METHOD_MAX 8
+#define ACCESSLOG_PATH_MAX 128  // Longer paths are cut short.
+#define ACCESSLOG_CACHE_LINE 64
+
+typedef struct accesslog_entry {
+  long time_us;     // Wall clock time the request was read at.
+  long duration_us; // From the first byte of the request to the last of the response.
+  long bytes;       // Response bytes written to the client.
+  int status;
+  unsigned int addr;   // Client address and port, in network byte order.
+  unsigned short port;
+  char method[ACCESSLOG_METHOD_MAX];
+  char path[ACCESSLOG_PATH_MAX];
+} accesslog_entry_t;
+
+/* head is only written by the writer and tail only by the owning thread, so
+ * each gets its own cache line. */
+typedef struct accesslog_ring {
+  accesslog_entry_t entries[ACCESSLOG_RING_SIZE];
+  unsigned long head __attribute__((aligned(ACCESSLOG_CACHE_LINE))); // Next entry to write out.
+  unsigned long tail __attribute__((aligned(ACCESSLOG_CACHE_LINE))); // Next entry to fill.
+  int retired; // Set when the owning thread exits; freed once drained.
+  struct accesslog_ring *next;
+  struct accesslog_ring *prev;
+} accesslog_ring_t;
+
+int accesslog_open(const char *path, double sample_rate);
+int accesslog_sample(void);
+void accesslog_write(accesslog_entry_t *entry);
+void accesslog_flush(void);
+
+#endif
@@ -0,0 +1,58 @@
+#!/bin/bash
+#
+# Runs httpbench against every server mode and prints one CSV row per run.
+#
+# Usage: ./bench.sh > bench.csv   (or: make bench)
+#
+# Settings come from the environment:
+#   MODES        server binaries to compare    (default: all of them)
+#   THREADS      thread counts for the modes that take --num-threads
+#   CONNECTIONS  concurrent client connections (default: 32)
+#   DURATION     seconds measured per run      (default: 5)
+#   KEEPALIVE    "1 0" runs both with and without persistent connections
+#   PORT         port the servers listen on    (default: 8000)
+
+MODES=${MODES:-"httpserver forkserver threadserver poolserver ringserver reuseportserver epollserver uringserver"}
+THREADS=${THREADS:-"1 2 4 8"}
+CONNECTIONS=${CONNECTIONS:-32}
+DURATION=${DURATION:-5}
+KEEPALIVE=${KEEPALIVE:-"1 0"}
+PORT=${PORT:-8000}
+
+cd "$(dirname "$0")"
+
+wait_for_port() {
+  for _ in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/$PORT) 2>/dev/null && return 0
+    sleep 0.1
+  done
+  return 1
+}
+
+echo "mode,threads,connections,keepalive,$(./httpbench --csv-header)"
+
+for mode in $MODES; do
+  case $mode in
+    poolserver|ringserver|reuseportserver|epollserver|uringserver) thread_counts=$THREADS ;;
+    *) thread_counts=1 ;;
+  esac
+
+  for threads in $thread_counts; do
+    for keepalive in $KEEPALIVE; do
+      ./$mode --files www --port $PORT --num-threads $threads > /dev/null 2>&1 &
+      server=$!
+      if ! wait_for_port; then
+        echo "$mode did not start" >&2
+        kill $server 2>/dev/null
+        continue
+      fi
+
+      flags="--port $PORT --connections $CONNECTIONS --duration $DURATION --csv"
+      [ "$keepalive" = 0 ] && flags="$flags --no-keepalive"
+      echo "$mode,$threads,$CONNECTIONS,$keepalive,$(./httpbench $flags)"
+
+      kill $server
+      wait $server 2>/dev/null || true
+    done
+  done
+done
@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "utlist.h"
+
+/* FNV-1a. The low bits pick the shard, the rest pick the bucket. */
+static unsigned cache_hash(const char *key) {
+  unsigned hash = 2166136261u;
+  for (; *key; key++) {
+    hash ^= (unsigned char) *key;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static time_t cache_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+static size_t entry_bytes(cache_entry_t *entry) {
+  return sizeof(cache_entry_t) + entry->headers_length + entry->data_length;
+}
+
+static int entry_matches(cache_entry_t *entry, struct stat *file_stat) {
+  return entry->dev == file_stat->st_dev
+      && entry->ino == file_stat->st_ino
+      && entry->size == file_stat->st_size
+      && entry->mtime.tv_sec == file_stat->st_mtim.tv_sec
+      && entry->mtime.tv_nsec == file_stat->st_mtim.tv_nsec;
+}
+
+/* Returns whether ENTRY still matches FILE_STAT, and the file its data was
+ * read from, if that is another one, is unchanged too. */
+static int entry_valid(cache_entry_t *entry, struct stat *file_stat) {
+  if (!entry_matches(entry, file_stat)) return 0;
+  if (entry->data_path == NULL) return 1;
+  struct stat data_stat;
+  return stat(entry->data_path, &data_stat) == 0
+      && entry->data_dev == data_stat.st_dev
+      && entry->data_ino == data_stat.st_ino
+      && entry->data_size == data_stat.st_size
+      && entry->data_mtime.tv_sec == data_stat.st_mtim.tv_sec
+      && entry->data_mtime.tv_nsec == data_stat.st_mtim.tv_nsec;
+}
+
+static cache_entry_t **bucket_of(cache_shard_t *shard, unsigned hash) {
+  return &shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+/* Initializes CACHE to hold at most CAPACITY bytes. A capacity of 0 disables
+ * the cache. */
+void cache_init(cache_t *cache, size_t capacity) {
+  memset(cache, 0, sizeof(cache_t));
+  for (int i = 0; i < CACHE_SHARDS; i++)
+    pthread_mutex_init(&cache->shards[i].mutex, NULL);
+  cache->shard_capacity = capacity / CACHE_SHARDS;
+  cache->max_entry_size = cache->shard_capacity / 4;
+}
+
+/* Returns whether a file of SIZE bytes is small enough to be cached. */
+int cache_admits(cache_t *cache, off_t size) {
+  return cache->shard_capacity > 0 && size <= (off_t) cache->max_entry_size;
+}
+
+/* Drops a reference to ENTRY, freeing it once nobody holds it anymore. */
+void cache_release(cache_entry_t *entry) {
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+  free(entry->key);
+  free(entry->file_path);
+  free(entry->data_path);
+  free(entry->headers);
+  free(entry->data);
+  free(entry);
+}
+
+/* Unlinks ENTRY from SHARD, which must be locked, and drops the shard's
+ * reference to it. */
+static void shard_remove(cache_shard_t *shard, cache_entry_t *entry) {
+  cache_entry_t **link = bucket_of(shard, entry->hash);
+  while (*link != entry) link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  DL_DELETE(shard->lru, entry);
+  shard->bytes -= entry_bytes(entry);
+  entry->cached = 0;
+  cache_release(entry);
+}
+
+static cache_entry_t *shard_find(cache_shard_t *shard, unsigned hash, const char *key) {
+  cache_entry_t *entry = *bucket_of(shard, hash);
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0))
+    entry = entry->hash_next;
+  return entry;
+}
+
+/* Looks up KEY. If FILE_STAT is given the entry must match it, otherwise the
+ * file is stat()ed again once the entry is CACHE_REVALIDATE_SECONDS old. */
+static cache_entry_t *cache_find(cache_t *cache, const char *key, struct stat *file_stat) {
+  if (cache->shard_capacity == 0) return NULL;
+
+  unsigned hash = cache_hash(key);
+  cache_shard_t *shard = &cache->shards[hash % CACHE_SHARDS];
+  time_t now = cache_now();
+
+  pthread_mutex_lock(&shard->mutex);
+  cache_entry_t *entry = shard_find(shard, hash, key);
+  int stale = 0;
+  if (entry != NULL) {
+    __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+    DL_DELETE(shard->lru, entry);
+    DL_PREPEND(shard->lru, entry);
+    stale = file_stat != NULL || now - entry->checked >= CACHE_REVALIDATE_SECONDS;
+  }
+  pthread_mutex_unlock(&shard->mutex);
+
+  if (entry == NULL) {
+    __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  if (stale) {
+    /* Stat outside the lock so other lookups in the shard are not held up. */
+    struct stat current_stat;
+    int valid = file_stat != NULL
+        ? entry_valid(entry, file_stat)
+        : stat(entry->file_path, &current_stat) == 0 && entry_valid(entry, &current_stat);
+
+    pthread_mutex_lock(&shard->mutex);
+    if (valid)
+      entry->checked = now;
+    else if (entry->cached)
+      shard_remove(shard, entry);
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (!valid) {
+      cache_release(entry);
+      __atomic_add_fetch(&cache->invalidations, 1, __ATOMIC_RELAXED);
+      __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+      return NULL;
+    }
+  }
+
+  __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+  return entry;
+}
+
+/* Returns the entry for KEY, or NULL on a miss. The caller owns a reference
+ * to the returned entry and must cache_release() it. */
+cache_entry_t *cache_lookup(cache_t *cache, const char *key) {
+  return cache_find(cache, key, NULL);
+}
+
+/* Like cache_lookup(), for a caller that has just stat()ed the entry's file
+ * itself: the entry is only returned if it was built from a file with the
+ * same FILE_STAT. */
+cache_entry_t *cache_lookup_stat(cache_t *cache, const char *key, struct stat *file_stat) {
+  return cache_find(cache, key, file_stat);
+}
+
+/* Creates an entry for KEY describing the file at FILE_PATH, with room for
+ * DATA_LENGTH bytes of data (for a plain file, its FILE_STAT->st_size). The
+ * caller fills in data and headers and owns the only reference. */
+cache_entry_t *cache_entry_create(const char *key, const char *file_path,
+    struct stat *file_stat, size_t data_length) {
+  cache_entry_t *entry = calloc(1, sizeof(cache_entry_t));
+  if (entry == NULL) return NULL;
+  entry->key = strdup(key);
+  entry->file_path = strdup(file_path);
+  entry->data = malloc(data_length > 0 ? data_length : 1);
+  if (!entry->key || !entry->file_path || !entry->data) {
+    entry->refcount = 1;
+    cache_release(entry);
+    return NULL;
+  }
+  entry->data_length = data_length;
+  entry->dev = file_stat->st_dev;
+  entry->ino = file_stat->st_ino;
+  entry->size = file_stat->st_size;
+  entry->mtime = file_stat->st_mtim;
+  entry->checked = cache_now();
+  entry->hash = cache_hash(key);
+  entry->refcount = 1;
+  return entry;
+}
+
+/* Records that ENTRY's data was read from DATA_PATH, whose stat() is
+ * DATA_STAT, rather than from its file_path, so that the entry is dropped when
+ * either file changes. Returns -1 if out of memory. */
+int cache_entry_set_data_file(cache_entry_t *entry, const char *data_path,
+    struct stat *data_stat) {
+  entry->data_path = strdup(data_path);
+  if (entry->data_path == NULL) return -1;
+  entry->data_dev = data_stat->st_dev;
+  entry->data_ino = data_stat->st_ino;
+  entry->data_size = data_stat->st_size;
+  entry->data_mtime = data_stat->st_mtim;
+  return 0;
+}
+
+/* Adds ENTRY to CACHE, replacing any older entry for the same key and evicting
+ * the least recently used entries of its shard to make room. */
+void cache_insert(cache_t *cache, cache_entry_t *entry) {
+  cache_shard_t *shard = &cache->shards[entry->hash % CACHE_SHARDS];
+  size_t bytes = entry_bytes(entry);
+
+  pthread_mutex_lock(&shard->mutex);
+  cache_entry_t *old = shard_find(shard, entry->hash, entry->key);
+  if (old != NULL) shard_remove(shard, old);
+
+  while (shard->lru != NULL && shard->bytes + bytes > cache->shard_capacity) {
+    shard_remove(shard, shard->lru->prev);
+    __atomic_add_fetch(&cache->evictions, 1, __ATOMIC_RELAXED);
+  }
+
+  __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+  entry->cached = 1;
+  entry->hash_next = *bucket_of(shard, entry->hash);
+  *bucket_of(shard, entry->hash) = entry;
+  DL_PREPEND(shard->lru, entry);
+  shard->bytes += bytes;
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+/* Copies CACHE's counters into STATS. */
+void cache_get_stats(cache_t *cache, cache_stats_t *stats) {
+  stats->hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+  stats->evictions = __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED);
+  stats->invalidations = __atomic_load_n(&cache->invalidations, __ATOMIC_RELAXED);
+  stats->bytes = 0;
+  for (int i = 0; i < CACHE_SHARDS; i++) {
+    pthread_mutex_lock(&cache->shards[i].mutex);
+    stats->bytes += cache->shards[i].bytes;
+    pthread_mutex_unlock(&cache->shards[i].mutex);
+  }
+}
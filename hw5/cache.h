@@ -0,0 +1,91 @@
+#ifndef __CACHE__
+#define __CACHE__
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* CACHE holds the contents of small, frequently requested files together with
+ * their precomputed response headers. It is split into shards, each with its
+ * own lock, hash table and LRU list, so that workers serving different files
+ * rarely contend. An entry is trusted for CACHE_REVALIDATE_SECONDS after it
+ * was last checked; after that the next lookup stat()s the file again and
+ * drops the entry if its size or mtime changed. An entry whose data was read
+ * from another file, such as a precompressed sidecar, is checked against that
+ * file as well. */
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 256
+#define CACHE_REVALIDATE_SECONDS 1
+#define CACHE_DEFAULT_CAPACITY (16 << 20)
+
+typedef struct cache_entry {
+  char *key;        // Request path the entry answers.
+  char *file_path;  // File the contents were read from.
+  char *headers;    // Entity headers, each ending in "\r\n".
+  size_t headers_length;
+  char *data;
+  size_t data_length;
+  char *encoding;   // Content-Encoding of the data, or NULL.
+  int vary;         // Whether the response depends on Accept-Encoding.
+
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  time_t checked;
+
+  /* File the data was read from when it is not file_path, or NULL. */
+  char *data_path;
+  dev_t data_dev;
+  ino_t data_ino;
+  off_t data_size;
+  struct timespec data_mtime;
+
+  unsigned hash;
+  int refcount;
+  int cached;       // Whether the entry is still in its shard.
+  struct cache_entry *hash_next;
+  struct cache_entry *next;
+  struct cache_entry *prev;
+} cache_entry_t;
+
+typedef struct cache_shard {
+  pthread_mutex_t mutex;
+  cache_entry_t *buckets[CACHE_BUCKETS];
+  cache_entry_t *lru; // Most recently used first.
+  size_t bytes;
+} cache_shard_t;
+
+typedef struct cache_stats {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned long invalidations;
+  size_t bytes;
+} cache_stats_t;
+
+typedef struct cache {
+  cache_shard_t shards[CACHE_SHARDS];
+  size_t shard_capacity;
+  size_t max_entry_size;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned long invalidations;
+} cache_t;
+
+void cache_init(cache_t *cache, size_t capacity);
+int cache_admits(cache_t *cache, off_t size);
+cache_entry_t *cache_lookup(cache_t *cache, const char *key);
+cache_entry_t *cache_lookup_stat(cache_t *cache, const char *key, struct stat *file_stat);
+cache_entry_t *cache_entry_create(const char *key, const char *file_path,
+    struct stat *file_stat, size_t data_length);
+int cache_entry_set_data_file(cache_entry_t *entry, const char *data_path,
+    struct stat *data_stat);
+void cache_insert(cache_t *cache, cache_entry_t *entry);
+void cache_release(cache_entry_t *entry);
+void cache_get_stats(cache_t *cache, cache_stats_t *stats);
+
+#endif
@@ -0,0 +1,73 @@
+#include <string.h>
+
+#include "codel.h"
+
+void codel_init(codel_t *codel, long target_us) {
+  memset(codel, 0, sizeof(codel_t));
+  pthread_mutex_init(&codel->mutex, NULL);
+  codel->target_us = target_us;
+}
+
+static unsigned long isqrt(unsigned long n) {
+  unsigned long root = 0, bit = 1UL << 62;
+  while (bit > n) bit >>= 2;
+  while (bit != 0) {
+    if (n >= root + bit) {
+      n -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+/* When to drop next: the gap between drops shrinks with the square root of
+ * the number of drops so far, which is what makes the drop rate rise until
+ * the queue comes back under the target. */
+static long codel_control_law(codel_t *codel, long now_us) {
+  return now_us + CODEL_INTERVAL_US / isqrt(codel->count);
+}
+
+/*
+ * Called by a worker for each connection it takes off the queue, after it
+ * has waited WAITED_US there. Returns whether the connection should be shed.
+ * Waits under the target cost only a lock-free check.
+ */
+int codel_should_drop(codel_t *codel, long waited_us, long now_us) {
+  if (codel->target_us == 0) return 0;
+  if (waited_us < codel->target_us
+      && __atomic_load_n(&codel->first_above_us, __ATOMIC_RELAXED) == 0
+      && !__atomic_load_n(&codel->dropping, __ATOMIC_RELAXED))
+    return 0;
+
+  int drop = 0;
+  pthread_mutex_lock(&codel->mutex);
+  if (waited_us < codel->target_us) {
+    __atomic_store_n(&codel->first_above_us, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&codel->dropping, 0, __ATOMIC_RELAXED);
+  } else if (codel->dropping) {
+    if (now_us >= codel->drop_next_us) {
+      drop = 1;
+      codel->count++;
+      codel->drop_next_us = codel_control_law(codel, codel->drop_next_us);
+    }
+  } else if (codel->first_above_us == 0) {
+    __atomic_store_n(&codel->first_above_us, now_us + CODEL_INTERVAL_US, __ATOMIC_RELAXED);
+  } else if (now_us >= codel->first_above_us) {
+    drop = 1;
+    __atomic_store_n(&codel->dropping, 1, __ATOMIC_RELAXED);
+    /* If we were dropping not long ago, pick up near the rate that was
+     * needed then instead of starting over. */
+    unsigned long delta = codel->count - codel->last_count;
+    if (delta > 1 && now_us - codel->drop_next_us < 16 * CODEL_INTERVAL_US)
+      codel->count = delta;
+    else
+      codel->count = 1;
+    codel->last_count = codel->count;
+    codel->drop_next_us = codel_control_law(codel, now_us);
+  }
+  pthread_mutex_unlock(&codel->mutex);
+  return drop;
+}
@@ -0,0 +1,30 @@
+#ifndef __CODEL__
+#define __CODEL__
+
+#include <pthread.h>
+
+/* CODEL decides which accepted connections the POOLSERVER sheds once it
+ * falls behind, after the CoDel queue discipline (RFC 8289). It looks at how
+ * long each connection waited in the work queue: short bursts are absorbed,
+ * but once every wait for a whole CODEL_INTERVAL_US has exceeded the target,
+ * connections are dropped, more often the longer the queue stays above the
+ * target, until one gets through in time again. Dropping by wait time rather
+ * than queue length keeps the latency of what is served bounded however fast
+ * the workers happen to be. */
+
+#define CODEL_INTERVAL_US 100000
+
+typedef struct codel {
+  long target_us;       // Acceptable queue wait; 0 disables shedding.
+  pthread_mutex_t mutex;
+  long first_above_us;  // When waits will have been above target for an interval.
+  int dropping;
+  long drop_next_us;
+  unsigned long count;      // Drops since entering the dropping state.
+  unsigned long last_count;
+} codel_t;
+
+void codel_init(codel_t *codel, long target_us);
+int codel_should_drop(codel_t *codel, long waited_us, long now_us);
+
+#endif
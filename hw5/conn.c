@@ -0,0 +1,623 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "stats.h"
+#include "utlist.h"
+
+#define CONN_RELAY_ROUNDS 4
+
+/* How long an idle persistent connection is kept open, and how many requests
+ * it may carry; how long a client may take to send a request's headers, and
+ * how long a response (or proxied exchange) may go without progress. Set from
+ * the command line. */
+int conn_keepalive_timeout_ms = CONN_KEEPALIVE_TIMEOUT_MS;
+int conn_max_requests = CONN_MAX_REQUESTS;
+int conn_header_timeout_ms = CONN_HEADER_TIMEOUT_MS;
+int conn_body_timeout_ms = CONN_BODY_TIMEOUT_MS;
+
+/* Puts FD into non-blocking mode. Returns -1 on failure. */
+int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Milliseconds on a monotonic clock. */
+long conn_now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * When the wait C's step function has just started should give up, as a
+ * conn_now_ms() time. An idle connection gets the keep-alive timeout, and one
+ * reading a request whatever is left of the header timeout, however slowly
+ * the bytes trickle in. Anything else, from sending a response to waiting on
+ * the proxy target, gets the body timeout, counted from the last progress.
+ */
+long conn_deadline(conn_t *c) {
+  long now = conn_now_ms();
+  if (c->idle) return now + conn_keepalive_timeout_ms;
+  if (c->header_deadline > 0) return c->header_deadline;
+  return now + conn_body_timeout_ms;
+}
+
+/* Creates the state for a freshly accepted CLIENT_FD, handled by STEP. */
+conn_t *conn_create(int client_fd, conn_step_t step) {
+  conn_t *c = calloc(1, sizeof(conn_t));
+  if (c == NULL) {
+    close(client_fd);
+    return NULL;
+  }
+  set_nonblocking(client_fd);
+  /* Responses are written whole, so there is nothing for Nagle to coalesce;
+   * it would only delay the next response on a persistent connection. */
+  int nodelay = 1;
+  setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  c->step = step;
+  c->client.fd = client_fd;
+  c->client.watched = -1;
+  c->client.conn = c;
+  c->target.fd = -1;
+  c->target.watched = -1;
+  c->target.conn = c;
+  c->file_fd = -1;
+  http_parser_init(&c->parser);
+  stats_count(STATS_CONNECTIONS_OPENED);
+  return c;
+}
+
+static void relay_free(conn_relay_t *r) {
+  if (r == NULL) return;
+  if (r->pipe[0] >= 0) close(r->pipe[0]);
+  if (r->pipe[1] >= 0) close(r->pipe[1]);
+  free(r);
+}
+
+/* Closes every descriptor owned by C and frees it. */
+void conn_destroy(conn_t *c) {
+  if (c->client.fd >= 0) close(c->client.fd);
+  if (c->target.fd >= 0) close(c->target.fd);
+  if (c->file_fd >= 0) close(c->file_fd);
+  if (c->body_release != NULL) c->body_release(c->body_owner);
+  conn_part_t *part, *tmp;
+  LL_FOREACH_SAFE(c->parts, part, tmp) {
+    free(part->data);
+    free(part);
+  }
+  free(c->out);
+  relay_free(c->upstream);
+  relay_free(c->downstream);
+  free(c);
+  stats_count(STATS_CONNECTIONS_CLOSED);
+}
+
+/* Drives C to completion, sleeping in poll() whenever it has to wait, then
+ * destroys it. Used by the one-connection-at-a-time server modes. The
+ * connection is closed when a wait outlasts conn_deadline(), so that a client
+ * that stalls ties up its thread for no longer than that. */
+void conn_run(conn_t *c) {
+  while (c->step(c)) {
+    /* Sockets with nothing to wait for are skipped (fd -1), so that hangups
+     * on them do not wake us up. */
+    struct pollfd fds[2];
+    fds[0].fd = c->client.events ? c->client.fd : -1;
+    fds[0].events = c->client.events;
+    fds[1].fd = c->target.events ? c->target.fd : -1;
+    fds[1].events = c->target.events;
+    long timeout = conn_deadline(c) - conn_now_ms();
+    int ready = poll(fds, 2, timeout > 0 ? timeout : 0);
+    if (ready == 0) break;
+    if (ready < 0 && errno != EINTR) break;
+  }
+  conn_destroy(c);
+}
+
+/* Takes in LENGTH bytes that have been read into the request buffer just past
+ * the bytes already there. Leftover body bytes of the last request are
+ * dropped. */
+void conn_received(conn_t *c, size_t length) {
+  char *read_start = c->request_buffer + c->request_length;
+  c->idle = 0;
+  if (c->discard > 0) {
+    size_t skip = c->discard < length ? c->discard : length;
+    memmove(read_start, read_start + skip, length - skip);
+    c->discard -= skip;
+    length -= skip;
+  }
+  c->request_length += length;
+}
+
+/* Starts the access log entry of the request just read. */
+static void conn_log_request(conn_t *c) {
+  accesslog_entry_t *log = &c->log;
+  if (!c->peer_known) {
+    struct sockaddr_in peer;
+    socklen_t peer_length = sizeof(peer);
+    memset(&peer, 0, sizeof(peer));
+    getpeername(c->client.fd, (struct sockaddr *) &peer, &peer_length);
+    log->addr = peer.sin_addr.s_addr;
+    log->port = peer.sin_port;
+    c->peer_known = 1;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  log->time_us = now.tv_sec * 1000000 + now.tv_nsec / 1000;
+  log->status = 0;
+  log->bytes = 0;
+  snprintf(log->method, sizeof(log->method), "%s",
+      c->request != NULL ? c->request->method : "");
+  snprintf(log->path, sizeof(log->path), "%s",
+      c->request != NULL ? c->request->path : "");
+  c->logged = 1;
+}
+
+/* Notes that C has to wait for more of a request. It is idle if nothing of
+ * the next request has arrived yet; otherwise the header timeout runs from
+ * the first wait. */
+void conn_wait_request(conn_t *c) {
+  c->idle = c->request_length == 0 && c->requests_served > 0;
+  if (!c->idle && c->header_deadline == 0)
+    c->header_deadline = conn_now_ms() + conn_header_timeout_ms;
+}
+
+/* Finishes reading a request, whether or not it parsed. */
+static int conn_request_read(conn_t *c) {
+  c->idle = 0;
+  c->header_deadline = 0;
+  c->client.events = 0;
+  c->keep_alive = c->request != NULL && c->request->keep_alive
+      && c->requests_served + 1 < conn_max_requests;
+  stats_count(STATS_REQUESTS);
+  c->request_parsed = stats_record_since(STATS_PARSE, c->request_started);
+  if (accesslog_sample()) conn_log_request(c);
+  return 1;
+}
+
+/* Parses the request bytes received so far. Returns 1 once the request is
+ * complete, leaving c->request NULL if it is malformed or too large, and 0
+ * if more bytes are needed. */
+int conn_parse_request(conn_t *c) {
+  if (c->request_started == 0 && c->request_length > 0)
+    c->request_started = stats_now_us();
+  int status = http_parser_execute(&c->parser, c->request_buffer, c->request_length);
+  if (status == HTTP_PARSE_COMPLETE)
+    c->request = &c->parser.request;
+  else if (status == HTTP_PARSE_NEED_MORE && c->request_length < LIBHTTP_REQUEST_MAX_SIZE)
+    return 0;
+  return conn_request_read(c);
+}
+
+/* Reads from the client until a whole request has been parsed. Returns 1 once
+ * it has, leaving c->request NULL if the request is malformed or too large,
+ * 0 when more data is needed, and -1 if the client went away before sending
+ * anything. Bytes that arrive after the request stay in the buffer for the
+ * next one. */
+int conn_read_request(conn_t *c) {
+  while (!conn_parse_request(c)) {
+    ssize_t bytes_read = read(c->client.fd, c->request_buffer + c->request_length,
+        LIBHTTP_REQUEST_MAX_SIZE - c->request_length);
+    if (bytes_read > 0) {
+      conn_received(c, bytes_read);
+    } else if (bytes_read == 0) {
+      if (c->request_length == 0) return -1;
+      return conn_request_read(c);
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      conn_wait_request(c);
+      c->client.events = POLLIN;
+      return 0;
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/* Gets C ready to read the next request on a persistent connection. Any
+ * pipelined bytes that followed the current request (and its body) are
+ * kept. */
+void conn_next_request(conn_t *c) {
+  size_t consumed = c->request->length + c->request->content_length;
+  if (consumed > c->request_length) {
+    c->discard = consumed - c->request_length;
+    consumed = c->request_length;
+  }
+  memmove(c->request_buffer, c->request_buffer + consumed, c->request_length - consumed);
+  c->request_length -= consumed;
+
+  http_parser_init(&c->parser);
+  c->request = NULL;
+  c->requests_served++;
+  c->keep_alive = 0;
+}
+
+static void conn_reserve(conn_t *c, size_t length) {
+  if (c->out_length + length <= c->out_capacity) return;
+  size_t capacity = c->out_capacity ? c->out_capacity : 256;
+  while (capacity < c->out_length + length) capacity *= 2;
+  c->out = realloc(c->out, capacity);
+  if (!c->out) {
+    fprintf(stderr, "Malloc failed\n");
+    exit(ENOBUFS);
+  }
+  c->out_capacity = capacity;
+}
+
+void conn_send_data(conn_t *c, const void *data, size_t length) {
+  conn_reserve(c, length);
+  memcpy(c->out + c->out_length, data, length);
+  c->out_length += length;
+}
+
+void conn_send_string(conn_t *c, char *data) {
+  conn_send_data(c, data, strlen(data));
+}
+
+static void conn_printf(conn_t *c, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+
+  conn_reserve(c, length + 1);
+  va_start(args, format);
+  vsnprintf(c->out + c->out_length, length + 1, format, args);
+  va_end(args);
+  c->out_length += length;
+}
+
+/* Buffered equivalents of http_start_response() and friends. Nothing is
+ * written to the socket until conn_flush(). conn_end_headers() adds the
+ * Connection header according to c->keep_alive, so every response sent on a
+ * persistent connection must carry a Content-Length. */
+void conn_start_response(conn_t *c, int status_code) {
+  stats_count_status(status_code);
+  c->log.status = status_code;
+  conn_printf(c, "HTTP/1.1 %d %s\r\n", status_code,
+      http_get_response_message(status_code));
+}
+
+void conn_send_header(conn_t *c, char *key, char *value) {
+  conn_printf(c, "%s: %s\r\n", key, value);
+}
+
+void conn_end_headers(conn_t *c) {
+  conn_send_header(c, "Connection", c->keep_alive ? "keep-alive" : "close");
+  conn_send_data(c, "\r\n", 2);
+}
+
+/* Queues LENGTH bytes at DATA to be sent after the buffered output without
+ * copying them. RELEASE(OWNER), if given, is called once they are no longer
+ * needed. */
+void conn_send_borrowed(conn_t *c, const char *data, size_t length,
+    void (*release)(void *owner), void *owner) {
+  c->body = data;
+  c->body_length = length;
+  c->body_sent = 0;
+  c->body_release = release;
+  c->body_owner = owner;
+}
+
+/* Queues LENGTH bytes of FILE_FD to be sent after the buffered output. C takes
+ * ownership of FILE_FD. Small files are read straight into the out buffer so
+ * that they go out in the same write as the headers; anything larger is left
+ * for conn_flush() to send with sendfile(). */
+void conn_send_file(conn_t *c, int file_fd, off_t length) {
+  c->file_fd = file_fd;
+  c->file_offset = 0;
+  c->file_remaining = length;
+  if (length > CONN_SMALL_FILE_SIZE) return;
+
+  conn_reserve(c, length);
+  while (c->file_remaining > 0) {
+    ssize_t bytes_read = pread(file_fd, c->out + c->out_length, c->file_remaining,
+        c->file_offset);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) return; // Let conn_flush() deal with it.
+    c->out_length += bytes_read;
+    c->file_offset += bytes_read;
+    c->file_remaining -= bytes_read;
+  }
+  close(file_fd);
+  c->file_fd = -1;
+}
+
+/* Queues LENGTH bytes of FILE_FD, starting at OFFSET, to be sent after the
+ * buffered output with sendfile(). C takes ownership of FILE_FD. */
+void conn_send_file_range(conn_t *c, int file_fd, off_t offset, off_t length) {
+  c->file_fd = file_fd;
+  c->file_offset = offset;
+  c->file_remaining = length;
+}
+
+/* Queues LENGTH bytes at DATA (copied), followed by FILE_LENGTH bytes of the
+ * file given to conn_send_file_range() starting at FILE_OFFSET, to be sent
+ * once everything queued before has been. */
+void conn_queue_part(conn_t *c, const char *data, size_t length,
+    off_t file_offset, off_t file_length) {
+  conn_part_t *part = malloc(sizeof(conn_part_t));
+  char *copy = malloc(length > 0 ? length : 1);
+  if (!part || !copy) {
+    fprintf(stderr, "Malloc failed\n");
+    exit(ENOBUFS);
+  }
+  memcpy(copy, data, length);
+  part->data = copy;
+  part->length = length;
+  part->file_offset = file_offset;
+  part->file_length = file_length;
+  LL_APPEND(c->parts, part);
+}
+
+/* Sends the next part of the queued file. Returns the number of bytes sent,
+ * or -1 with errno set. Uses sendfile() so the data never passes through user
+ * space, and falls back to a read/write through the out buffer if the file
+ * cannot be used with sendfile(). */
+static ssize_t conn_send_file_chunk(conn_t *c) {
+  if (!c->file_no_sendfile) {
+    ssize_t bytes_sent = sendfile(c->client.fd, c->file_fd, &c->file_offset, c->file_remaining);
+    if (bytes_sent > 0) c->log.bytes += bytes_sent;
+    if (bytes_sent >= 0 || (errno != EINVAL && errno != ENOSYS)) return bytes_sent;
+    c->file_no_sendfile = 1;
+  }
+
+  size_t chunk = CONN_FILE_CHUNK_SIZE;
+  if ((off_t) chunk > c->file_remaining) chunk = c->file_remaining;
+  conn_reserve(c, chunk);
+  ssize_t bytes_read = pread(c->file_fd, c->out, chunk, c->file_offset);
+  if (bytes_read > 0) {
+    c->out_length = bytes_read;
+    c->file_offset += bytes_read;
+  }
+  return bytes_read;
+}
+
+/* Points IOV at the unsent parts of the out buffer and the borrowed body.
+ * Returns how many of its two entries are used. */
+int conn_buffers(conn_t *c, struct iovec iov[2]) {
+  int iovcnt = 0;
+  if (c->out_sent < c->out_length) {
+    iov[iovcnt].iov_base = c->out + c->out_sent;
+    iov[iovcnt++].iov_len = c->out_length - c->out_sent;
+  }
+  if (c->body_sent < c->body_length) {
+    iov[iovcnt].iov_base = (char *) c->body + c->body_sent;
+    iov[iovcnt++].iov_len = c->body_length - c->body_sent;
+  }
+  return iovcnt;
+}
+
+/* Marks LENGTH bytes of what conn_buffers() returned as written. */
+void conn_buffers_sent(conn_t *c, size_t length) {
+  size_t out_written = c->out_length - c->out_sent;
+  if (length < out_written) out_written = length;
+  c->out_sent += out_written;
+  c->body_sent += length - out_written;
+  c->log.bytes += length;
+}
+
+/* Writes the unsent parts of the out buffer and the borrowed body to the
+ * client, together in one gathered write. When a file follows, the write is
+ * flagged MSG_MORE (a one-shot TCP_CORK), so that the headers are not pushed
+ * out in a packet of their own ahead of the first sendfile() segment. */
+static ssize_t conn_write_buffers(conn_t *c) {
+  struct iovec iov[2];
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = iov;
+  message.msg_iovlen = conn_buffers(c, iov);
+  ssize_t bytes_written = sendmsg(c->client.fd, &message,
+      c->file_remaining > 0 || c->parts != NULL ? MSG_MORE : 0);
+  if (bytes_written > 0) conn_buffers_sent(c, bytes_written);
+  return bytes_written;
+}
+
+/* Writes buffered output, then the borrowed body, then the queued file, to the
+ * client. Returns 1 when everything has been sent, 0 if the socket would
+ * block, and -1 on error. */
+int conn_flush(conn_t *c) {
+  while (1) {
+    if (c->out_sent < c->out_length || c->body_sent < c->body_length) {
+      ssize_t bytes_written = conn_write_buffers(c);
+      if (bytes_written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          c->client.events = POLLOUT;
+          return 0;
+        }
+        if (errno != EINTR) return -1;
+      }
+      continue;
+    }
+
+    if (c->body_release != NULL) {
+      c->body_release(c->body_owner);
+      c->body_release = NULL;
+    }
+    c->body = NULL;
+    c->body_length = c->body_sent = 0;
+    c->out_length = c->out_sent = 0;
+    if (c->file_remaining <= 0 && c->parts != NULL) {
+      conn_part_t *part = c->parts;
+      LL_DELETE(c->parts, part);
+      conn_send_data(c, part->data, part->length);
+      c->file_offset = part->file_offset;
+      c->file_remaining = part->file_length;
+      free(part->data);
+      free(part);
+      continue;
+    }
+    if (c->file_remaining <= 0) break;
+
+    ssize_t bytes_sent = conn_send_file_chunk(c);
+    if (bytes_sent > 0) {
+      c->file_remaining -= bytes_sent;
+    } else if (bytes_sent == 0) {
+      return -1; // File shrank under us.
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      c->client.events = POLLOUT;
+      return 0;
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+
+  if (c->file_fd >= 0) {
+    close(c->file_fd);
+    c->file_fd = -1;
+  }
+  c->client.events = 0;
+  return 1;
+}
+
+/* Records, once the response to the current request has been sent, how long
+ * writing it took and how long the whole request took, and logs the request
+ * if it was sampled. */
+void conn_finish_response(conn_t *c) {
+  long now = stats_now_us();
+  if (c->response_built > 0) stats_record(STATS_SEND, now - c->response_built);
+  if (c->request_started > 0) stats_record(STATS_TOTAL, now - c->request_started);
+  if (c->logged) {
+    c->log.duration_us = c->request_started > 0 ? now - c->request_started : 0;
+    accesslog_write(&c->log);
+    c->logged = 0;
+  }
+  c->request_started = c->request_parsed = c->response_built = 0;
+}
+
+/* Reads up to WANT bytes from FROM into R: spliced into R's pipe if
+ * possible, otherwise copied into R's buffer. Only called once both are
+ * empty, so EAGAIN always means FROM has nothing to read. */
+static ssize_t relay_fill(conn_endpoint_t *from, conn_relay_t *r, size_t want) {
+  if (!r->no_splice && r->pipe[0] < 0) {
+    if (pipe2(r->pipe, O_NONBLOCK | O_CLOEXEC) < 0) r->no_splice = 1;
+    else fcntl(r->pipe[1], F_SETPIPE_SZ, CONN_SPLICE_CHUNK);
+  }
+
+  if (!r->no_splice) {
+    ssize_t bytes_read = splice(from->fd, NULL, r->pipe[1], NULL, want,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes_read > 0) r->piped = bytes_read;
+    if (bytes_read >= 0 || errno != EINVAL) return bytes_read;
+    r->no_splice = 1;
+  }
+
+  if (want > sizeof(r->data)) want = sizeof(r->data);
+  ssize_t bytes_read = read(from->fd, r->data, want);
+  if (bytes_read > 0) {
+    r->length = bytes_read;
+    r->sent = 0;
+  }
+  return bytes_read;
+}
+
+/* Writes R's pending bytes, buffered ones first, to TO. */
+static ssize_t relay_drain(conn_endpoint_t *to, conn_relay_t *r) {
+  if (r->sent < r->length) {
+    ssize_t bytes_written = write(to->fd, r->data + r->sent, r->length - r->sent);
+    if (bytes_written > 0) r->sent += bytes_written;
+    return bytes_written;
+  }
+  ssize_t bytes_written = splice(r->pipe[0], NULL, to->fd, NULL, r->piped,
+      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (bytes_written > 0) r->piped -= bytes_written;
+  return bytes_written;
+}
+
+/* Moves bytes FROM -> TO through R. Returns 1 once R->remaining bytes have
+ * been relayed (or, if R->remaining is -1, once FROM has hit EOF) and
+ * everything has been written, 0 while waiting on either socket, and -1 on
+ * error, including FROM closing early. Nothing more is read from FROM until
+ * TO has taken what was read before, so a slow reader holds back a fast
+ * writer instead of making the relay buffer without bound. Gives up after a
+ * few rounds so one busy stream cannot starve the other connections sharing
+ * an event loop. */
+int conn_pump(conn_endpoint_t *from, conn_endpoint_t *to, conn_relay_t *r) {
+  int rounds = 0;
+  while (rounds < CONN_RELAY_ROUNDS) {
+    if (r->sent < r->length || r->piped > 0) {
+      ssize_t bytes_written = relay_drain(to, r);
+      if (bytes_written >= 0) continue;
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      return -1;
+    }
+    if (r->eof || r->remaining == 0) return 1;
+
+    size_t want = CONN_SPLICE_CHUNK;
+    if (r->remaining > 0 && (size_t) r->remaining < want) want = r->remaining;
+    ssize_t bytes_read = relay_fill(from, r, want);
+    if (bytes_read > 0) {
+      if (r->remaining > 0) r->remaining -= bytes_read;
+      rounds++;
+    } else if (bytes_read == 0) {
+      if (r->remaining > 0) return -1;
+      r->eof = 1;
+      shutdown(to->fd, SHUT_WR);
+      return 1;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+
+  if (r->sent < r->length || r->piped > 0)
+    to->events |= POLLOUT;
+  else
+    from->events |= POLLIN;
+  return 0;
+}
+
+static conn_relay_t *relay_create(void) {
+  conn_relay_t *r = calloc(1, sizeof(conn_relay_t));
+  if (r == NULL) return NULL;
+  r->pipe[0] = r->pipe[1] = -1;
+  r->remaining = -1;
+  return r;
+}
+
+/* Allocates C's relay buffers, if it has none yet, set up to relay until EOF.
+ * Returns -1 if out of memory. */
+int conn_alloc_relays(conn_t *c) {
+  if (c->upstream == NULL) c->upstream = relay_create();
+  if (c->downstream == NULL) c->downstream = relay_create();
+  return c->upstream && c->downstream ? 0 : -1;
+}
+
+/* Relays traffic in both directions between the client and target sockets,
+ * half-closing each side as its peer finishes. Returns non-zero while the
+ * relay is still running. */
+int conn_relay(conn_t *c) {
+  if (conn_alloc_relays(c) < 0) return 0;
+  c->client.events = c->target.events = 0;
+  int up = conn_pump(&c->client, &c->target, c->upstream);
+  int down = conn_pump(&c->target, &c->client, c->downstream);
+  if (up < 0 || down < 0) return 0;
+  return !(up && down);
+}
+
+/* Takes the target socket away from C, first making sure no event loop is
+ * still watching it. Returns the descriptor, which the caller now owns. */
+int conn_detach_target(conn_t *c) {
+  int fd = c->target.fd;
+  if (c->unwatch != NULL && c->target.watched >= 0) c->unwatch(&c->target);
+  c->target.fd = -1;
+  c->target.events = 0;
+  c->target.watched = -1;
+  return fd;
+}
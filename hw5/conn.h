@@ -0,0 +1,193 @@
+#ifndef __CONN__
+#define __CONN__
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "accesslog.h"
+#include "libhttp.h"
+#include "wheel.h"
+
+/* CONN is the per-connection state shared by every server mode. Request
+ * handlers are written as resumable state machines over a conn: each call
+ * to the handler's step function makes as much progress as the (non-blocking)
+ * sockets allow, records which events it is waiting on, and returns. The
+ * blocking server modes drive one conn at a time with conn_run(), while the
+ * EPOLLSERVER drives many conns from a single event loop. The URINGSERVER
+ * does the socket I/O of the files handler itself, through the pieces of
+ * conn_read_request() and conn_flush() that do no I/O. */
+
+#define CONN_RELAY_BUFFER_SIZE 16384
+#define CONN_FILE_CHUNK_SIZE 8192
+#define CONN_SMALL_FILE_SIZE 16384
+#define CONN_KEEPALIVE_TIMEOUT_MS 5000
+#define CONN_HEADER_TIMEOUT_MS 10000
+#define CONN_BODY_TIMEOUT_MS 30000
+#define CONN_MAX_REQUESTS 100
+#define CONN_SPLICE_CHUNK 262144
+
+struct conn;
+
+/* A socket belonging to a conn. EVENTS holds the POLLIN/POLLOUT bits the
+ * state machine is waiting for; WATCHED is what the event loop last
+ * registered (-1 when not registered yet). */
+typedef struct conn_endpoint {
+  int fd;
+  int events;
+  int watched;
+  struct conn *conn;
+} conn_endpoint_t;
+
+/* Bytes read from one socket that still have to be written to the other.
+ * Relayed bytes normally move through PIPE with splice(), so they never enter
+ * user space; DATA holds bytes the conn has already read itself (such as a
+ * response head the proxy parsed) and is written out first. REMAINING is how
+ * many more bytes to read before the relay is done, or -1 to relay until
+ * EOF. */
+typedef struct conn_relay {
+  char data[CONN_RELAY_BUFFER_SIZE];
+  size_t length;
+  size_t sent;
+  int pipe[2];
+  size_t piped;    // Bytes sitting in the pipe.
+  int no_splice;   // Set once splice() has refused these sockets.
+  long remaining;
+  int eof;
+} conn_relay_t;
+
+/* A further piece of a response made of several slices of one file, as a
+ * multipart/byteranges response is: DATA is sent, then FILE_LENGTH bytes of
+ * the response's file from FILE_OFFSET. */
+typedef struct conn_part {
+  char *data;
+  size_t length;
+  off_t file_offset;
+  off_t file_length;
+  struct conn_part *next;
+} conn_part_t;
+
+/* Makes progress on C. Returns non-zero while C is waiting on events, and 0
+ * once the connection is finished and may be destroyed. */
+typedef int (*conn_step_t)(struct conn *c);
+
+typedef struct conn {
+  int state;
+  conn_step_t step;
+  conn_endpoint_t client;
+  conn_endpoint_t target; // Only used by the proxy handler.
+
+  /* Request bytes read from the client so far, and the parser working
+   * through them. request points into the parser once a request has been
+   * parsed, and is NULL for a malformed request. */
+  char request_buffer[LIBHTTP_REQUEST_MAX_SIZE];
+  size_t request_length;
+  size_t discard; // Body bytes of the last request still to be skipped.
+  struct http_parser parser;
+  struct http_request *request;
+
+  /* When the current request's first byte was read, when it was parsed and
+   * when its response was ready to send, as stats_now_us() timestamps (0
+   * until reached). */
+  long request_started;
+  long request_parsed;
+  long response_built;
+
+  /* Access log entry of the current request, if it was sampled. The client
+   * address in it is looked up for the first logged request only. */
+  int logged;
+  int peer_known;
+  accesslog_entry_t log;
+
+  /* Persistent connection state. The conn is idle while it waits for the
+   * next request after having answered one. */
+  int keep_alive;
+  int requests_served;
+  int idle;
+
+  /* When the request being read must have arrived, as a conn_now_ms() time
+   * (0 when not reading one), and the event loop's timer for whatever the
+   * conn is waiting on (see conn_deadline()). */
+  long header_deadline;
+  wheel_timer_t timer;
+
+  /* Response bytes not yet written to the client. */
+  char *out;
+  size_t out_length;
+  size_t out_sent;
+  size_t out_capacity;
+
+  /* Borrowed body that follows the out buffer, if any. body_release is
+   * called with body_owner once the body has been sent or dropped. */
+  const char *body;
+  size_t body_length;
+  size_t body_sent;
+  void (*body_release)(void *owner);
+  void *body_owner;
+
+  /* File whose contents follow the body, if any, and the slice of it still
+   * to send. parts lists the pieces that follow, for multi-slice responses. */
+  int file_fd;
+  off_t file_offset;
+  off_t file_remaining;
+  int file_no_sendfile; // Set once sendfile() has refused file_fd.
+  conn_part_t *parts;
+
+  conn_relay_t *upstream;   // client -> target
+  conn_relay_t *downstream; // target -> client
+
+  /* Proxy state. The target is only reused for another request, by this
+   * conn or through the upstream pool, if its response had a known length. */
+  int tunnel;          // Relaying raw bytes instead of one request at a time.
+  int target_pooled;   // The target came from the upstream pool.
+  int target_retried;  // The request is being resent on a fresh target.
+  int target_reusable;
+  size_t forward_sent; // Request bytes written to the target so far.
+
+  /* Set by an event loop driving the conn. unwatch stops the loop from
+   * watching an endpoint, so that its descriptor can be handed elsewhere. */
+  void *loop;
+  void (*unwatch)(conn_endpoint_t *endpoint);
+  struct conn *next; // Used by event loops to defer freeing.
+} conn_t;
+
+extern int conn_keepalive_timeout_ms;
+extern int conn_header_timeout_ms;
+extern int conn_body_timeout_ms;
+extern int conn_max_requests;
+
+conn_t *conn_create(int client_fd, conn_step_t step);
+void conn_destroy(conn_t *c);
+void conn_run(conn_t *c);
+
+int conn_read_request(conn_t *c);
+void conn_wait_request(conn_t *c);
+void conn_received(conn_t *c, size_t length);
+int conn_parse_request(conn_t *c);
+void conn_next_request(conn_t *c);
+
+void conn_start_response(conn_t *c, int status_code);
+void conn_send_header(conn_t *c, char *key, char *value);
+void conn_end_headers(conn_t *c);
+void conn_send_data(conn_t *c, const void *data, size_t length);
+void conn_send_string(conn_t *c, char *data);
+void conn_send_borrowed(conn_t *c, const char *data, size_t length,
+    void (*release)(void *owner), void *owner);
+void conn_send_file(conn_t *c, int file_fd, off_t length);
+void conn_send_file_range(conn_t *c, int file_fd, off_t offset, off_t length);
+void conn_queue_part(conn_t *c, const char *data, size_t length,
+    off_t file_offset, off_t file_length);
+int conn_buffers(conn_t *c, struct iovec iov[2]);
+void conn_buffers_sent(conn_t *c, size_t length);
+int conn_flush(conn_t *c);
+void conn_finish_response(conn_t *c);
+
+int conn_alloc_relays(conn_t *c);
+int conn_pump(conn_endpoint_t *from, conn_endpoint_t *to, conn_relay_t *r);
+int conn_relay(conn_t *c);
+int conn_detach_target(conn_t *c);
+
+int set_nonblocking(int fd);
+long conn_now_ms(void);
+long conn_deadline(conn_t *c);
+
+#endif
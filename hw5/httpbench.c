@@ -0,0 +1,476 @@
+/*
+ * HTTP load generator for comparing the server modes.
+ *
+ * Usage: ./httpbench [--port 8000] [--connections 32] [--threads 1]
+ *                    [--duration 10] [--warmup 1] [--no-keepalive]
+ *                    [--root www] [--urls FILE] [--csv] [--csv-header]
+ *
+ * Keeps N connections busy against a server on 127.0.0.1, each sending one
+ * request at a time and the next one as soon as the response is complete.
+ * Requests cycle through a URL mix: every file and directory under --root
+ * (the directory the server was started with), or the paths listed one per
+ * line in --urls. With --no-keepalive every request opens a new connection,
+ * and its latency includes the handshake.
+ *
+ * Reports throughput and latency percentiles over the measured period, which
+ * starts after the warmup. Latencies are kept exactly, not bucketed.
+ */
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libhttp.h"
+
+#define BENCH_MAX_EVENTS 64
+#define BENCH_HEAD_SIZE 8192
+#define BENCH_READ_SIZE 65536
+
+enum {
+  BENCH_CONNECTING,
+  BENCH_SENDING,
+  BENCH_READING,
+};
+
+typedef struct bench_conn {
+  int fd;
+  int state;
+  int url_index;
+  size_t request_sent;
+  char head[BENCH_HEAD_SIZE];
+  size_t head_length;
+  int head_done;
+  long body_remaining; // -1 when the body runs until the server closes.
+  int server_keep_alive;
+  long start_us;
+} bench_conn_t;
+
+typedef struct bench_thread {
+  pthread_t thread;
+  int index;
+  int num_conns;
+  /* Results for the measured period. */
+  unsigned *latencies; // Microseconds.
+  size_t num_latencies;
+  size_t latencies_capacity;
+  unsigned long bytes;
+  unsigned long errors;
+  unsigned long bad_statuses;
+} bench_thread_t;
+
+/* Settings, from the command line. */
+static struct sockaddr_in server_address;
+static int num_conns = 32;
+static int num_threads = 1;
+static int duration = 10;
+static int warmup = 1;
+static int keep_alive = 1;
+
+/* Requests in the URL mix, ready to send. */
+static char **requests;
+static size_t *request_lengths;
+static int num_requests;
+
+static long measure_start_us;
+static long measure_end_us;
+
+static long now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000L + now.tv_nsec / 1000;
+}
+
+static void fatal(const char *message) {
+  perror(message);
+  exit(errno ? errno : 1);
+}
+
+static void add_url(const char *path) {
+  requests = realloc(requests, (num_requests + 1) * sizeof(char *));
+  request_lengths = realloc(request_lengths, (num_requests + 1) * sizeof(size_t));
+  if (!requests || !request_lengths) fatal("Malloc failed");
+  int length = asprintf(&requests[num_requests],
+      "GET %s HTTP/1.1\r\nHost: localhost\r\nUser-Agent: httpbench\r\n%s\r\n",
+      path, keep_alive ? "" : "Connection: close\r\n");
+  if (length < 0) fatal("Malloc failed");
+  request_lengths[num_requests++] = length;
+}
+
+/* Adds every file and directory under ROOT/PATH to the URL mix. */
+static void add_urls_under(const char *root, const char *path) {
+  char *directory_path;
+  if (asprintf(&directory_path, "%s%s", root, path) < 0) fatal("Malloc failed");
+  DIR *directory = opendir(directory_path);
+  if (directory == NULL) fatal(directory_path);
+  add_url(path);
+
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+    char *url, *file_path;
+    if (asprintf(&url, "%s%s", path, entry->d_name) < 0
+        || asprintf(&file_path, "%s%s", directory_path, entry->d_name) < 0)
+      fatal("Malloc failed");
+    struct stat file_stat;
+    if (stat(file_path, &file_stat) == 0 && S_ISDIR(file_stat.st_mode)) {
+      char *subdirectory;
+      if (asprintf(&subdirectory, "%s/", url) < 0) fatal("Malloc failed");
+      add_urls_under(root, subdirectory);
+      free(subdirectory);
+    } else if (S_ISREG(file_stat.st_mode)) {
+      add_url(url);
+    }
+    free(url);
+    free(file_path);
+  }
+  closedir(directory);
+  free(directory_path);
+}
+
+static void add_urls_from(const char *file_name) {
+  FILE *file = fopen(file_name, "r");
+  if (file == NULL) fatal(file_name);
+  char line[1024];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '/') add_url(line);
+  }
+  fclose(file);
+}
+
+static void record(bench_thread_t *t, long latency_us) {
+  if (t->num_latencies == t->latencies_capacity) {
+    t->latencies_capacity = t->latencies_capacity ? t->latencies_capacity * 2 : 65536;
+    t->latencies = realloc(t->latencies, t->latencies_capacity * sizeof(unsigned));
+    if (!t->latencies) fatal("Malloc failed");
+  }
+  t->latencies[t->num_latencies++] = latency_us;
+}
+
+static int measuring(long now) {
+  return now >= measure_start_us && now < measure_end_us;
+}
+
+static void watch(int epoll_fd, bench_conn_t *conn, int op, unsigned events) {
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = conn;
+  epoll_ctl(epoll_fd, op, conn->fd, &event);
+}
+
+/* Opens a new connection for CONN and starts its next request. */
+static void bench_connect(int epoll_fd, bench_conn_t *conn) {
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (conn->fd < 0) fatal("Failed to create socket");
+  int nodelay = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  conn->state = BENCH_CONNECTING;
+  if (connect(conn->fd, (struct sockaddr *) &server_address, sizeof(server_address)) == 0)
+    conn->state = BENCH_SENDING;
+  watch(epoll_fd, conn, EPOLL_CTL_ADD, EPOLLOUT);
+}
+
+static void bench_start_request(bench_conn_t *conn, long now) {
+  conn->start_us = now;
+  conn->request_sent = 0;
+  conn->head_length = 0;
+  conn->head_done = 0;
+  conn->url_index = (conn->url_index + 1) % num_requests;
+}
+
+/* Drops CONN's connection after an error and starts over on a new one. */
+static void bench_reset(int epoll_fd, bench_thread_t *t, bench_conn_t *conn) {
+  if (measuring(now_us())) t->errors++;
+  close(conn->fd);
+  bench_start_request(conn, now_us());
+  bench_connect(epoll_fd, conn);
+}
+
+/* Called once CONN's response is complete. */
+static void bench_finish(int epoll_fd, bench_thread_t *t, bench_conn_t *conn, int status_code) {
+  long now = now_us();
+  if (measuring(now)) {
+    record(t, now - conn->start_us);
+    if (status_code >= 400) t->bad_statuses++;
+  }
+  bench_start_request(conn, now);
+  if (keep_alive && conn->server_keep_alive) {
+    conn->state = BENCH_SENDING;
+    watch(epoll_fd, conn, EPOLL_CTL_MOD, EPOLLOUT);
+  } else {
+    close(conn->fd);
+    bench_connect(epoll_fd, conn);
+  }
+}
+
+static void bench_read(int epoll_fd, bench_thread_t *t, bench_conn_t *conn) {
+  static __thread char scratch[BENCH_READ_SIZE];
+  while (1) {
+    char *buffer = conn->head_done ? scratch : conn->head + conn->head_length;
+    size_t size = conn->head_done ? sizeof(scratch) : sizeof(conn->head) - conn->head_length;
+    if (conn->head_done && conn->body_remaining >= 0 && (size_t) conn->body_remaining < size)
+      size = conn->body_remaining;
+
+    ssize_t bytes_read = size > 0 ? read(conn->fd, buffer, size) : 0;
+    if (bytes_read < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      if (errno == EINTR) continue;
+      bench_reset(epoll_fd, t, conn);
+      return;
+    }
+    if (measuring(now_us())) t->bytes += bytes_read;
+
+    if (bytes_read == 0) {
+      /* Only a response without a length may end with the connection. */
+      if (conn->head_done && conn->body_remaining < 0) {
+        conn->server_keep_alive = 0;
+        struct http_response_head head;
+        http_response_head_parse(conn->head, conn->head_length, &head);
+        bench_finish(epoll_fd, t, conn, head.status_code);
+      } else {
+        bench_reset(epoll_fd, t, conn);
+      }
+      return;
+    }
+
+    if (!conn->head_done) {
+      conn->head_length += bytes_read;
+      struct http_response_head head;
+      int status = http_response_head_parse(conn->head, conn->head_length, &head);
+      if (status == HTTP_PARSE_NEED_MORE && conn->head_length < sizeof(conn->head)) continue;
+      if (status != HTTP_PARSE_COMPLETE || head.chunked) {
+        bench_reset(epoll_fd, t, conn);
+        return;
+      }
+      conn->head_done = 1;
+      conn->server_keep_alive = head.keep_alive;
+      conn->body_remaining = head.content_length;
+      if (head.status_code == 204 || head.status_code == 304) conn->body_remaining = 0;
+      if (conn->body_remaining >= 0) {
+        conn->body_remaining -= conn->head_length - head.length;
+        if (conn->body_remaining < 0) {
+          bench_reset(epoll_fd, t, conn); // Bytes beyond the response.
+          return;
+        }
+      }
+      /* The head is kept (truncated to its own length) for the status code. */
+      conn->head_length = head.length;
+    } else if (conn->body_remaining > 0) {
+      conn->body_remaining -= bytes_read;
+    }
+
+    if (conn->body_remaining == 0) {
+      struct http_response_head head;
+      http_response_head_parse(conn->head, conn->head_length, &head);
+      bench_finish(epoll_fd, t, conn, head.status_code);
+      return;
+    }
+  }
+}
+
+static void bench_event(int epoll_fd, bench_thread_t *t, bench_conn_t *conn) {
+  if (conn->state == BENCH_CONNECTING) {
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+    if (error != 0) {
+      bench_reset(epoll_fd, t, conn);
+      return;
+    }
+    conn->state = BENCH_SENDING;
+  }
+
+  if (conn->state == BENCH_SENDING) {
+    char *request = requests[conn->url_index];
+    size_t length = request_lengths[conn->url_index];
+    while (conn->request_sent < length) {
+      ssize_t bytes_written = write(conn->fd, request + conn->request_sent,
+          length - conn->request_sent);
+      if (bytes_written < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+        if (errno == EINTR) continue;
+        bench_reset(epoll_fd, t, conn);
+        return;
+      }
+      conn->request_sent += bytes_written;
+    }
+    conn->state = BENCH_READING;
+    watch(epoll_fd, conn, EPOLL_CTL_MOD, EPOLLIN);
+  }
+
+  bench_read(epoll_fd, t, conn);
+}
+
+static void *bench_thread(void *void_thread) {
+  bench_thread_t *t = void_thread;
+  int epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) fatal("Failed to create epoll instance");
+
+  bench_conn_t *conns = calloc(t->num_conns, sizeof(bench_conn_t));
+  if (conns == NULL) fatal("Malloc failed");
+  for (int i = 0; i < t->num_conns; i++) {
+    /* Spread the connections over the URL mix. */
+    conns[i].url_index = (t->index * t->num_conns + i) % num_requests;
+    bench_start_request(&conns[i], now_us());
+    bench_connect(epoll_fd, &conns[i]);
+  }
+
+  struct epoll_event events[BENCH_MAX_EVENTS];
+  while (now_us() < measure_end_us) {
+    int num_events = epoll_wait(epoll_fd, events, BENCH_MAX_EVENTS, 100);
+    if (num_events < 0 && errno != EINTR) fatal("Failed to wait for events");
+    for (int i = 0; i < num_events; i++)
+      bench_event(epoll_fd, t, events[i].data.ptr);
+  }
+
+  for (int i = 0; i < t->num_conns; i++) close(conns[i].fd);
+  free(conns);
+  close(epoll_fd);
+  return NULL;
+}
+
+static int compare_unsigned(const void *a, const void *b) {
+  unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+  return x < y ? -1 : x > y;
+}
+
+static unsigned percentile(unsigned *sorted, size_t count, double fraction) {
+  if (count == 0) return 0;
+  size_t index = (size_t) (fraction * count);
+  if (index >= count) index = count - 1;
+  return sorted[index];
+}
+
+char *USAGE =
+  "Usage: ./httpbench [--port 8000] [--connections 32] [--threads 1]\n"
+  "                   [--duration 10] [--warmup 1] [--no-keepalive]\n"
+  "                   [--root www] [--urls FILE] [--csv] [--csv-header]\n";
+
+static void exit_with_usage(void) {
+  fprintf(stderr, "%s", USAGE);
+  exit(EXIT_SUCCESS);
+}
+
+static int int_argument(char **argv, int *i, int minimum) {
+  char *value = argv[++*i];
+  if (!value || atoi(value) < minimum) {
+    fprintf(stderr, "Expected integer >= %d after %s\n", minimum, argv[*i - 1]);
+    exit_with_usage();
+  }
+  return atoi(value);
+}
+
+int main(int argc, char **argv) {
+  int port = 8000;
+  char *root = "www";
+  char *urls_file = NULL;
+  int csv = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp("--port", argv[i]) == 0) {
+      port = int_argument(argv, &i, 1);
+    } else if (strcmp("--connections", argv[i]) == 0) {
+      num_conns = int_argument(argv, &i, 1);
+    } else if (strcmp("--threads", argv[i]) == 0) {
+      num_threads = int_argument(argv, &i, 1);
+    } else if (strcmp("--duration", argv[i]) == 0) {
+      duration = int_argument(argv, &i, 1);
+    } else if (strcmp("--warmup", argv[i]) == 0) {
+      warmup = int_argument(argv, &i, 0);
+    } else if (strcmp("--no-keepalive", argv[i]) == 0) {
+      keep_alive = 0;
+    } else if (strcmp("--root", argv[i]) == 0) {
+      if (!(root = argv[++i])) exit_with_usage();
+    } else if (strcmp("--urls", argv[i]) == 0) {
+      if (!(urls_file = argv[++i])) exit_with_usage();
+    } else if (strcmp("--csv", argv[i]) == 0) {
+      csv = 1;
+    } else if (strcmp("--csv-header", argv[i]) == 0) {
+      printf("requests,errors,bad_statuses,seconds,requests_per_second,mb_per_second,"
+             "p50_us,p99_us,p999_us,max_us\n");
+      return 0;
+    } else {
+      exit_with_usage();
+    }
+  }
+
+  if (urls_file != NULL) add_urls_from(urls_file);
+  else add_urls_under(root, "/");
+  if (num_requests == 0) {
+    fprintf(stderr, "No URLs to request\n");
+    return 1;
+  }
+
+  memset(&server_address, 0, sizeof(server_address));
+  server_address.sin_family = AF_INET;
+  server_address.sin_port = htons(port);
+  server_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if (num_threads > num_conns) num_threads = num_conns;
+  measure_start_us = now_us() + warmup * 1000000L;
+  measure_end_us = measure_start_us + duration * 1000000L;
+
+  bench_thread_t *threads = calloc(num_threads, sizeof(bench_thread_t));
+  if (threads == NULL) fatal("Malloc failed");
+  for (int i = 0; i < num_threads; i++) {
+    threads[i].index = i;
+    threads[i].num_conns = num_conns / num_threads + (i < num_conns % num_threads);
+    if (pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]) != 0)
+      fatal("Failed to create thread");
+  }
+
+  size_t count = 0;
+  unsigned long bytes = 0, errors = 0, bad_statuses = 0;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+    count += threads[i].num_latencies;
+    bytes += threads[i].bytes;
+    errors += threads[i].errors;
+    bad_statuses += threads[i].bad_statuses;
+  }
+
+  unsigned *latencies = malloc((count ? count : 1) * sizeof(unsigned));
+  if (latencies == NULL) fatal("Malloc failed");
+  size_t offset = 0;
+  for (int i = 0; i < num_threads; i++) {
+    memcpy(latencies + offset, threads[i].latencies, threads[i].num_latencies * sizeof(unsigned));
+    offset += threads[i].num_latencies;
+    free(threads[i].latencies);
+  }
+  qsort(latencies, count, sizeof(unsigned), compare_unsigned);
+
+  double rate = count / (double) duration;
+  double mb_rate = bytes / (double) duration / 1e6;
+  unsigned p50 = percentile(latencies, count, 0.50);
+  unsigned p99 = percentile(latencies, count, 0.99);
+  unsigned p999 = percentile(latencies, count, 0.999);
+  unsigned max = count ? latencies[count - 1] : 0;
+
+  if (csv) {
+    printf("%zu,%lu,%lu,%d,%.1f,%.2f,%u,%u,%u,%u\n", count, errors, bad_statuses,
+        duration, rate, mb_rate, p50, p99, p999, max);
+  } else {
+    printf("%d connections (%s), %d URLs, %d s\n", num_conns,
+        keep_alive ? "keep-alive" : "one request each", num_requests, duration);
+    printf("  %zu requests, %lu errors, %lu 4xx/5xx\n", count, errors, bad_statuses);
+    printf("  %.1f requests/s, %.2f MB/s\n", rate, mb_rate);
+    printf("  latency p50 %u us, p99 %u us, p99.9 %u us, max %u us\n", p50, p99, p999, max);
+  }
+
+  free(latencies);
+  free(threads);
+  return 0;
+}
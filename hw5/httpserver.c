@@ -1,77 +1,642 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <unistd.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "accesslog.h"
+#include "cache.h"
+#include "codel.h"
+#include "conn.h"
 #include "libhttp.h"
+#include "pool.h"
+#include "stats.h"
+#include "upstream.h"
+#include "uring.h"
+#include "utlist.h"
 #include "wq.h"
 
+/* Without the io_uring header, the uringserver is built as an epollserver. */
+#if defined(URINGSERVER) && !defined(URING_AVAILABLE)
+#warning "<linux/io_uring.h> not found, building the uringserver as an epollserver"
+#undef URINGSERVER
+#define EPOLLSERVER
+#endif
+
 /*
  * Global configuration variables.
- * You need to use these in your implementation of handle_files_request and
- * handle_proxy_request. Their values are set up in main() using the
- * command line arguments (already implemented for you).
+ * These are used by handle_files_request and handle_proxy_request. Their
+ * values are set up in main() using the command line arguments.
  */
 wq_t work_queue;  // Only used by poolserver
-int num_threads;  // Only used by poolserver
+long queue_limit; // Only used by poolserver; 0 for no limit
+codel_t codel;    // Only used by poolserver
+long codel_target_ms; // Only used by poolserver; 0 disables CoDel
+pool_t pool;      // Only used by poolserver
+int max_threads;  // Only used by poolserver; 0 for a fixed pool of num_threads
+long worker_idle_timeout_ms; // Only used by poolserver
+int num_threads;  // Only used by poolserver, reuseportserver, epollserver and uringserver
+int pin_cpus;     // Only used by reuseportserver, epollserver and uringserver
+conn_step_t request_step; // Only used by epollserver and uringserver
 int server_port;  // Default value: 8000
+int server_fd;
+sigset_t shutdown_signals; // Blocked everywhere, taken by signal_thread().
 char *server_files_directory;
 char *server_proxy_hostname;
 int server_proxy_port;
+upstream_t upstream; // Only used by the proxy handler
+cache_t file_cache; // Only used by the files handler
+cache_t listing_cache; // Only used by the files handler
+char *access_log_path;   // NULL for no access log
+double access_log_sample; // Fraction of requests logged; default 1
+long cache_size = CACHE_DEFAULT_CAPACITY;
+
+/* States of the files handler's state machine. */
+enum {
+  FILES_READ_REQUEST,
+  FILES_SEND_RESPONSE,
+};
+
+/* States of the proxy handler's state machine. */
+enum {
+  PROXY_READ_REQUEST,
+  PROXY_CONNECT,
+  PROXY_CONNECTING,
+  PROXY_CONNECTED,
+  PROXY_SEND_REQUEST,
+  PROXY_READ_RESPONSE,
+  PROXY_SEND_RESPONSE,
+  PROXY_RELAY,
+  PROXY_BAD_GATEWAY,
+  PROXY_SEND_ERROR,
+  PROXY_DONE,
+};
+
+/*
+ * Queues an empty response with the given status code.
+ */
+void serve_error(conn_t *c, int status_code) {
+  conn_start_response(c, status_code);
+  conn_send_header(c, "Content-Type", "text/html");
+  conn_send_header(c, "Content-Length", "0");
+  conn_end_headers(c);
+}
+
+/* Samples the gauges of the stats report that depend on the server mode. */
+static void sample_gauges(stats_gauges_t *gauges) {
+  gauges->queue_depth = -1;
+  gauges->accept_backlog = -1;
+#ifdef POOLSERVER
+  gauges->queue_depth = wq_size(&work_queue);
+#endif
+#ifndef REUSEPORTSERVER
+  /* For a listening socket, tcpi_unacked is the length of its accept queue.
+   * The reuseportserver has one queue per worker, so it is left out. */
+  struct tcp_info info;
+  socklen_t info_length = sizeof(info);
+  if (getsockopt(server_fd, IPPROTO_TCP, TCP_INFO, &info, &info_length) == 0)
+    gauges->accept_backlog = info.tcpi_unacked;
+#endif
+}
+
+#define STATS_PATH "/__stats"
+
+/*
+ * Returns whether the request asks for the server's own statistics, which
+ * are served at STATS_PATH as text, or as JSON with "?format=json" or when
+ * the client accepts application/json. *JSON is set accordingly.
+ */
+static int stats_requested(struct http_request *request, int *json) {
+  if (request == NULL || strncmp(request->path, STATS_PATH, strlen(STATS_PATH)) != 0)
+    return 0;
+  char *rest = request->path + strlen(STATS_PATH);
+  const struct http_header *accept = http_request_header(request, "Accept");
+  *json = accept != NULL && strstr(accept->value, "application/json") != NULL;
+  if (strcmp(rest, "?format=json") == 0)
+    *json = 1;
+  else if (rest[0] != '\0')
+    return 0;
+  return 1;
+}
+
+/*
+ * Queues the stats report: per-stage latency histograms, counters and
+ * gauges (see stats.h).
+ */
+static void serve_stats(conn_t *c, int json) {
+  stats_gauges_t gauges;
+  sample_gauges(&gauges);
+  char *report;
+  size_t report_length;
+  FILE *out = open_memstream(&report, &report_length);
+  stats_write(out, json, &gauges);
+  fclose(out);
+
+  char content_length[24];
+  snprintf(content_length, sizeof(content_length), "%zu", report_length);
+  conn_start_response(c, 200);
+  conn_send_header(c, "Content-Type", json ? "application/json" : "text/plain");
+  conn_send_header(c, "Content-Length", content_length);
+  conn_send_header(c, "Cache-Control", "no-store");
+  conn_end_headers(c);
+  conn_send_borrowed(c, report, report_length, free, report);
+}
+
+/*
+ * Entity tag and Last-Modified date of a file, derived from its stat() so that
+ * they change whenever the file does. Each encoding of the file gets an entity
+ * tag of its own.
+ */
+typedef struct file_validators {
+  char etag[64];
+  char last_modified[64];
+  time_t mtime;
+} file_validators_t;
+
+static void file_validators(file_validators_t *validators, ino_t ino, off_t size,
+    struct timespec *mtime, char *encoding) {
+  unsigned long long mtime_ns = mtime->tv_sec * 1000000000ULL + mtime->tv_nsec;
+  snprintf(validators->etag, sizeof(validators->etag), "\"%lx-%llx-%llx%s%s\"",
+      (unsigned long) ino, (unsigned long long) size, mtime_ns,
+      encoding != NULL ? "-" : "", encoding != NULL ? encoding : "");
+  http_format_date(validators->last_modified, sizeof(validators->last_modified),
+      mtime->tv_sec);
+  validators->mtime = mtime->tv_sec;
+}
+
+static void send_validator_headers(conn_t *c, file_validators_t *validators) {
+  conn_send_header(c, "ETag", validators->etag);
+  conn_send_header(c, "Last-Modified", validators->last_modified);
+}
+
+/*
+ * What is sent for a requested file: the file itself, or its precompressed
+ * sidecar, the same path with ".gz" appended (see precompress.sh).
+ */
+typedef struct file_variant {
+  char *key;          // File cache key of the variant.
+  char *path;         // File the body is read from.
+  struct stat *stat;
+  char *encoding;     // Content-Encoding of the body, or NULL.
+  int vary;           // Whether the file has a sidecar, so the choice depends on Accept-Encoding.
+  char *sidecar_key;  // Owned by the variant, like sidecar_path; NULL without a sidecar.
+  char *sidecar_path;
+  struct stat sidecar_stat;
+} file_variant_t;
+
+/* Only text is worth keeping a compressed copy of. */
+static int mime_type_compressible(char *mime_type) {
+  return strncmp(mime_type, "text/", 5) == 0
+      || strcmp(mime_type, "application/javascript") == 0;
+}
+
+/* Returns the file cache key of the gzip variant of `key`, which cannot clash
+ * with the key of any request since those all start with "./". */
+static char *gzip_key(char *key) {
+  char *gzip = malloc(strlen("gzip:") + strlen(key) + 1);
+  if (gzip != NULL) sprintf(gzip, "gzip:%s", key);
+  return gzip;
+}
+
+/* Returns whether the request read into `c` would take a gzip variant. Range
+ * requests are always answered from the file itself, so that a range means
+ * the same bytes to every client. */
+static int request_accepts_gzip(conn_t *c) {
+  const struct http_header *header = http_request_header(c->request, "Accept-Encoding");
+  return header != NULL && http_request_header(c->request, "Range") == NULL
+      && http_accepts_encoding(header->value, header->value_length, "gzip");
+}
+
+/*
+ * Chooses the variant of the file at `path`, requested as `key`, to send to
+ * the client of `c`: its sidecar if the client accepts gzip and the sidecar
+ * is at least as new as the file, and otherwise the file itself. Release it
+ * with file_variant_free().
+ */
+static void file_variant_choose(file_variant_t *variant, conn_t *c, char *key, char *path,
+    struct stat *path_stat) {
+  memset(variant, 0, sizeof(file_variant_t));
+  variant->key = key;
+  variant->path = path;
+  variant->stat = path_stat;
+  if (!mime_type_compressible(http_get_mime_type(path))) return;
+
+  variant->sidecar_path = malloc(strlen(path) + strlen(".gz") + 1);
+  if (variant->sidecar_path == NULL) return;
+  sprintf(variant->sidecar_path, "%s.gz", path);
+  struct stat *sidecar_stat = &variant->sidecar_stat;
+  if (stat(variant->sidecar_path, sidecar_stat) < 0 || !S_ISREG(sidecar_stat->st_mode)
+      || sidecar_stat->st_mtim.tv_sec < path_stat->st_mtim.tv_sec)
+    return;
+  variant->vary = 1;
+
+  if (!request_accepts_gzip(c)) return;
+  variant->sidecar_key = gzip_key(key);
+  if (variant->sidecar_key == NULL) return;
+  variant->key = variant->sidecar_key;
+  variant->path = variant->sidecar_path;
+  variant->stat = sidecar_stat;
+  variant->encoding = "gzip";
+}
+
+static void file_variant_free(file_variant_t *variant) {
+  free(variant->sidecar_key);
+  free(variant->sidecar_path);
+}
+
+static void send_variant_headers(conn_t *c, char *encoding, int vary) {
+  if (encoding != NULL) conn_send_header(c, "Content-Encoding", encoding);
+  if (vary) conn_send_header(c, "Vary", "Accept-Encoding");
+}
+
+/*
+ * Returns whether the client of `c` already holds the current version of the
+ * file: If-None-Match takes precedence, and If-Modified-Since is only looked at
+ * without it.
+ */
+static int request_not_modified(conn_t *c, file_validators_t *validators) {
+  const struct http_header *header = http_request_header(c->request, "If-None-Match");
+  if (header != NULL)
+    return http_etag_matches(header->value, header->value_length, validators->etag);
+
+  header = http_request_header(c->request, "If-Modified-Since");
+  if (header == NULL) return 0;
+  time_t since = http_parse_date(header->value, header->value_length);
+  return since >= 0 && validators->mtime <= since;
+}
+
+static void serve_not_modified(conn_t *c, file_validators_t *validators, int vary) {
+  conn_start_response(c, 304);
+  send_validator_headers(c, validators);
+  send_variant_headers(c, NULL, vary);
+  conn_end_headers(c);
+}
 
 /*
- * Serves the contents the file stored at `path` to the client socket `fd`.
- * It is the caller's reponsibility to ensure that the file stored at `path` exists.
+ * Queues the contents of the file stored at `path` to be sent to the client of `c`.
+ * `path_stat` is the caller's stat() of the file, and `variant` says which
+ * copy of it to send, whose size is the Content-Length. It is the caller's
+ * reponsibility to ensure that the file stored at `path` exists.
  */
-void serve_file(int fd, char *path) {
+void serve_file(conn_t *c, char *path, struct stat *path_stat, file_variant_t *variant) {
 
-  /* TODO: PART 2 */
   /* PART 2 BEGIN */
 
-  http_start_response(fd, 200);
-  http_send_header(fd, "Content-Type", http_get_mime_type(path));
-  http_send_header(fd, "Content-Length", "0"); // TODO: change this line too
-  http_end_headers(fd);
+  int file_fd = open(variant->path, O_RDONLY);
+  if (file_fd < 0) {
+    serve_error(c, 404);
+    return;
+  }
 
+  char content_length[32];
+  snprintf(content_length, sizeof(content_length), "%lld", (long long) variant->stat->st_size);
+  file_validators_t validators;
+  file_validators(&validators, path_stat->st_ino, path_stat->st_size, &path_stat->st_mtim,
+      variant->encoding);
+
+  conn_start_response(c, 200);
+  conn_send_header(c, "Content-Type", http_get_mime_type(path));
+  conn_send_header(c, "Content-Length", content_length);
+  send_variant_headers(c, variant->encoding, variant->vary);
+  send_validator_headers(c, &validators);
+  conn_send_header(c, "Accept-Ranges", "bytes");
+  conn_end_headers(c);
+  conn_send_file(c, file_fd, variant->stat->st_size);
 
   /* PART 2 END */
 }
 
-void serve_directory(int fd, char *path) {
-  http_start_response(fd, 200);
-  http_send_header(fd, "Content-Type", http_get_mime_type(".html"));
-  http_end_headers(fd);
+static void release_cache_entry(void *entry) {
+  cache_release(entry);
+}
 
-  /* TODO: PART 3 */
-  /* PART 3 BEGIN */
+/*
+ * Fills in the entity headers of cache `entry` for a body of type `mime_type`,
+ * including the file's validators if `validators` is given, and the entry's
+ * encoding. Returns -1 if out of memory.
+ */
+static int cache_entry_set_headers(cache_entry_t *entry, char *mime_type,
+    file_validators_t *validators) {
+  char validator_headers[256] = "";
+  size_t length = 0;
+  if (entry->encoding != NULL)
+    length += snprintf(validator_headers, sizeof(validator_headers),
+        "Content-Encoding: %s\r\n", entry->encoding);
+  if (entry->vary)
+    length += snprintf(validator_headers + length, sizeof(validator_headers) - length,
+        "Vary: Accept-Encoding\r\n");
+  if (validators != NULL)
+    snprintf(validator_headers + length, sizeof(validator_headers) - length,
+        "ETag: %s\r\nLast-Modified: %s\r\nAccept-Ranges: bytes\r\n",
+        validators->etag, validators->last_modified);
+
+  char *format = "Content-Type: %s\r\nContent-Length: %lld\r\n%s";
+  long long data_length = entry->data_length;
+  entry->headers_length = snprintf(NULL, 0, format, mime_type, data_length, validator_headers);
+  entry->headers = malloc(entry->headers_length + 1);
+  if (entry->headers == NULL) return -1;
+  snprintf(entry->headers, entry->headers_length + 1, format, mime_type, data_length,
+      validator_headers);
+  return 0;
+}
 
-  // TODO: Open the directory (Hint: opendir() may be useful here)
+/*
+ * Queues the response held by cache `entry`. Takes over the caller's reference
+ * to `entry`; the body is sent straight from the cache without copying.
+ */
+void serve_cached(conn_t *c, cache_entry_t *entry) {
+  conn_start_response(c, 200);
+  conn_send_data(c, entry->headers, entry->headers_length);
+  conn_end_headers(c);
+  conn_send_borrowed(c, entry->data, entry->data_length, release_cache_entry, entry);
+}
 
-  /**
-   * TODO: For each entry in the directory (Hint: look at the usage of readdir() ),
-   * send a string containing a properly formatted HTML. (Hint: the http_format_href()
-   * function in libhttp.c may be useful here)
-   */
+/*
+ * Reads `variant` of the file stored at `path` into a new entry of the file
+ * cache, along with its response headers. The entry is checked against the
+ * file itself and, for a sidecar, against the sidecar too, so it is dropped
+ * when either of them changes or the sidecar goes away. Returns the entry
+ * with a reference held for the caller, or NULL if the file could not be
+ * read.
+ */
+static cache_entry_t *cache_load_file(char *path, struct stat *path_stat,
+    file_variant_t *variant) {
+  int file_fd = open(variant->path, O_RDONLY);
+  if (file_fd < 0) return NULL;
+
+  cache_entry_t *entry = cache_entry_create(variant->key, path, path_stat,
+      variant->stat->st_size);
+  size_t bytes_total = 0;
+  while (entry != NULL && bytes_total < entry->data_length) {
+    ssize_t bytes_read = read(file_fd, entry->data + bytes_total,
+        entry->data_length - bytes_total);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) {
+      cache_release(entry);
+      entry = NULL;
+      break;
+    }
+    bytes_total += bytes_read;
+  }
+  close(file_fd);
+  if (entry == NULL) return NULL;
+  if (variant->path != path
+      && cache_entry_set_data_file(entry, variant->path, variant->stat) < 0) {
+    cache_release(entry);
+    return NULL;
+  }
+
+  entry->encoding = variant->encoding;
+  entry->vary = variant->vary;
+  file_validators_t validators;
+  file_validators(&validators, entry->ino, entry->size, &entry->mtime, entry->encoding);
+  if (cache_entry_set_headers(entry, http_get_mime_type(path), &validators) < 0) {
+    cache_release(entry);
+    return NULL;
+  }
+
+  cache_insert(&file_cache, entry);
+  return entry;
+}
+
+/*
+ * Returns the Range header of `c`'s request if it should be honoured, that is
+ * unless an If-Range names some other version of the file.
+ */
+static const struct http_header *request_range(conn_t *c, file_validators_t *validators) {
+  const struct http_header *range = http_request_header(c->request, "Range");
+  if (range == NULL) return NULL;
+
+  const struct http_header *if_range = http_request_header(c->request, "If-Range");
+  if (if_range == NULL) return range;
+  if (if_range->value_length > 0 && if_range->value[0] == '"') {
+    size_t etag_length = strlen(validators->etag);
+    if (if_range->value_length == etag_length
+        && strncmp(if_range->value, validators->etag, etag_length) == 0)
+      return range;
+    return NULL;
+  }
+  if (http_parse_date(if_range->value, if_range->value_length) == validators->mtime)
+    return range;
+  return NULL;
+}
+
+/*
+ * Answers a Range request for the file stored at `path` with 206 Partial
+ * Content, sending only the requested slices straight from the file with
+ * sendfile(); several ranges go out as multipart/byteranges. Answers 416 if no
+ * range is satisfiable. Returns -1, having queued nothing, if the whole file
+ * should be sent instead.
+ */
+static int serve_file_ranges(conn_t *c, char *path, struct stat *path_stat,
+    file_validators_t *validators, int vary) {
+  const struct http_header *range = request_range(c, validators);
+  if (range == NULL) return -1;
+
+  struct http_range ranges[LIBHTTP_MAX_RANGES];
+  long long size = path_stat->st_size;
+  int num_ranges = http_parse_ranges(range->value, range->value_length, size,
+      ranges, LIBHTTP_MAX_RANGES);
+  if (num_ranges < 0) return -1;
+
+  char content_range[96];
+  if (num_ranges == 0) {
+    snprintf(content_range, sizeof(content_range), "bytes */%lld", size);
+    conn_start_response(c, 416);
+    conn_send_header(c, "Content-Range", content_range);
+    conn_send_header(c, "Content-Length", "0");
+    conn_end_headers(c);
+    return 0;
+  }
+
+  int file_fd = open(path, O_RDONLY);
+  if (file_fd < 0) return -1;
+  char *mime_type = http_get_mime_type(path);
+  char content_length[32];
+
+  if (num_ranges == 1) {
+    long long first = ranges[0].first, last = ranges[0].last;
+    snprintf(content_range, sizeof(content_range), "bytes %lld-%lld/%lld", first, last, size);
+    snprintf(content_length, sizeof(content_length), "%lld", last - first + 1);
+    conn_start_response(c, 206);
+    conn_send_header(c, "Content-Type", mime_type);
+    conn_send_header(c, "Content-Range", content_range);
+    conn_send_header(c, "Content-Length", content_length);
+    send_variant_headers(c, NULL, vary);
+    send_validator_headers(c, validators);
+    conn_end_headers(c);
+    conn_send_file_range(c, file_fd, first, last - first + 1);
+    return 0;
+  }
+
+  /* Each slice is preceded by its own part headers, and the body ends with
+   * the closing boundary; all of it is counted into the Content-Length. */
+  static unsigned long boundary_counter;
+  char boundary[64];
+  snprintf(boundary, sizeof(boundary), "httpserver-%lx-%lx", (unsigned long) path_stat->st_ino,
+      __atomic_add_fetch(&boundary_counter, 1, __ATOMIC_RELAXED));
+
+  char part_headers[LIBHTTP_MAX_RANGES][256];
+  size_t part_lengths[LIBHTTP_MAX_RANGES];
+  long long total = 0;
+  for (int i = 0; i < num_ranges; i++) {
+    long long first = ranges[i].first, last = ranges[i].last;
+    part_lengths[i] = snprintf(part_headers[i], sizeof(part_headers[i]),
+        "%s--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+        i == 0 ? "" : "\r\n", boundary, mime_type, first, last, size);
+    total += part_lengths[i] + (last - first + 1);
+  }
+  char closing[96];
+  size_t closing_length = snprintf(closing, sizeof(closing), "\r\n--%s--\r\n", boundary);
+  total += closing_length;
+
+  char content_type[128];
+  snprintf(content_type, sizeof(content_type), "multipart/byteranges; boundary=%s", boundary);
+  snprintf(content_length, sizeof(content_length), "%lld", total);
+  conn_start_response(c, 206);
+  conn_send_header(c, "Content-Type", content_type);
+  conn_send_header(c, "Content-Length", content_length);
+  send_variant_headers(c, NULL, vary);
+  send_validator_headers(c, validators);
+  conn_end_headers(c);
+
+  conn_send_data(c, part_headers[0], part_lengths[0]);
+  conn_send_file_range(c, file_fd, ranges[0].first, ranges[0].last - ranges[0].first + 1);
+  for (int i = 1; i < num_ranges; i++)
+    conn_queue_part(c, part_headers[i], part_lengths[i], ranges[i].first,
+        ranges[i].last - ranges[i].first + 1);
+  conn_queue_part(c, closing, closing_length, 0, 0);
+  return 0;
+}
+
+/*
+ * Serves the file stored at `path` in answer to a request for `key`: 304 if
+ * the client's copy is current, the requested ranges if it asked for some,
+ * and otherwise the whole file, or its sidecar if the client takes gzip, from
+ * the file cache when it is small enough to be cached.
+ */
+static void serve_file_or_cache(conn_t *c, char *key, char *path, struct stat *path_stat) {
+  file_variant_t variant;
+  file_variant_choose(&variant, c, key, path, path_stat);
+  file_validators_t validators;
+  file_validators(&validators, path_stat->st_ino, path_stat->st_size, &path_stat->st_mtim,
+      variant.encoding);
+  if (request_not_modified(c, &validators)) {
+    serve_not_modified(c, &validators, variant.vary);
+  } else if (variant.encoding != NULL
+      || serve_file_ranges(c, path, path_stat, &validators, variant.vary) < 0) {
+    cache_entry_t *entry = NULL;
+    if (cache_admits(&file_cache, variant.stat->st_size))
+      entry = cache_load_file(path, path_stat, &variant);
+    if (entry != NULL)
+      serve_cached(c, entry);
+    else
+      serve_file(c, path, path_stat, &variant);
+  }
+  file_variant_free(&variant);
+}
+
+/*
+ * Renders the listing of the directory at `path` as HTML. Returns a buffer the
+ * caller must free, with its length in `*listing_length`, or NULL.
+ */
+static char *render_directory(char *path, size_t *listing_length) {
+  char *listing = NULL;
+  FILE *listing_stream = open_memstream(&listing, listing_length);
+  if (listing_stream == NULL) return NULL;
+
+  /* PART 3 BEGIN */
+
+  DIR *directory = opendir(path);
+  if (directory != NULL) {
+    /* Links are formatted from the path without its trailing slashes. */
+    size_t path_length = strlen(path);
+    while (path_length > 1 && path[path_length - 1] == '/') path_length--;
+    char *link_path = strndup(path, path_length);
+
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+      if (strcmp(entry->d_name, ".") == 0) continue;
+      size_t length = strlen("<a href=\"//\"></a><br/>") + path_length
+          + 2 * strlen(entry->d_name) + 1;
+      char *href = malloc(length);
+      http_format_href(href, link_path, entry->d_name);
+      fprintf(listing_stream, "%s\n", href);
+      free(href);
+    }
+    free(link_path);
+    closedir(directory);
+  }
 
   /* PART 3 END */
+
+  fclose(listing_stream);
+  return listing;
 }
 
+/*
+ * Queues the listing of the directory at `path`, whose stat() is `path_stat`.
+ * Rendered listings are kept in the listing cache until the directory's mtime
+ * changes, so a repeat request costs no readdir() at all. The listing is sent
+ * as one buffer with a Content-Length, which persistent connections need.
+ */
+void serve_directory(conn_t *c, char *path, struct stat *path_stat) {
+  cache_entry_t *entry = cache_lookup_stat(&listing_cache, path, path_stat);
+  if (entry != NULL) {
+    serve_cached(c, entry);
+    return;
+  }
+
+  size_t listing_length = 0;
+  char *listing = render_directory(path, &listing_length);
+  if (listing == NULL) {
+    serve_error(c, 500);
+    return;
+  }
+
+  if (cache_admits(&listing_cache, listing_length)) {
+    entry = cache_entry_create(path, path, path_stat, listing_length);
+    if (entry != NULL) {
+      memcpy(entry->data, listing, listing_length);
+      if (cache_entry_set_headers(entry, http_get_mime_type(".html"), NULL) == 0) {
+        cache_insert(&listing_cache, entry);
+        serve_cached(c, entry);
+        free(listing);
+        return;
+      }
+      cache_release(entry);
+    }
+  }
+
+  char content_length[32];
+  snprintf(content_length, sizeof(content_length), "%zu", listing_length);
+
+  conn_start_response(c, 200);
+  conn_send_header(c, "Content-Type", http_get_mime_type(".html"));
+  conn_send_header(c, "Content-Length", content_length);
+  conn_end_headers(c);
+  conn_send_borrowed(c, listing, listing_length, free, listing);
+}
 
 /*
- * Reads an HTTP request from client socket (fd), and writes an HTTP response
- * containing:
+ * Builds the response to the request read into `c`:
  *
  *   1) If user requested an existing file, respond with the file
  *   2) If user requested a directory and index.html exists in the directory,
@@ -79,26 +644,23 @@ void serve_directory(int fd, char *path) {
  *   3) If user requested a directory and index.html doesn't exist, send a list
  *      of files in the directory with links to each.
  *   4) Send a 404 Not Found response.
- *
- *   Closes the client socket (fd) when finished.
  */
-void handle_files_request(int fd) {
-
-  struct http_request *request = http_request_parse(fd);
+static void files_respond(conn_t *c) {
+  struct http_request *request = c->request;
 
   if (request == NULL || request->path[0] != '/') {
-    http_start_response(fd, 400);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    close(fd);
+    serve_error(c, 400);
+    return;
+  }
+
+  int json;
+  if (stats_requested(request, &json)) {
+    serve_stats(c, json);
     return;
   }
 
   if (strstr(request->path, "..") != NULL) {
-    http_start_response(fd, 403);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    close(fd);
+    serve_error(c, 403);
     return;
   }
 
@@ -108,94 +670,407 @@ void handle_files_request(int fd) {
   path[1] = '/';
   memcpy(path + 2, request->path, strlen(request->path) + 1);
 
-  /*
-   * TODO: PART 2 is to serve files. If the file given by `path` exists,
-   * call serve_file() on it. Else, serve a 404 Not Found error below.
-   * The `stat()` syscall will be useful here.
-   *
-   * TODO: PART 3 is to serve both files and directories. You will need to
-   * determine when to call serve_file() or serve_directory() depending
-   * on `path`. Make your edits below here in this function.
-   */
+  /* Hot files are answered from memory, without touching the filesystem.
+   * Range requests are left to serve_file_or_cache(), which sends the
+   * slices from the file itself. Clients that take gzip look for the
+   * sidecar's entry first; if only the file's own entry is cached and it
+   * has a sidecar, serve_file_or_cache() loads the sidecar. */
+  cache_entry_t *entry = NULL;
+  if (request_accepts_gzip(c)) {
+    char *key = gzip_key(path);
+    if (key != NULL) entry = cache_lookup(&file_cache, key);
+    free(key);
+    if (entry == NULL) {
+      entry = cache_lookup(&file_cache, path);
+      if (entry != NULL && entry->vary) {
+        cache_release(entry);
+        entry = NULL;
+      }
+    }
+  } else {
+    entry = cache_lookup(&file_cache, path);
+  }
+  if (entry != NULL) {
+    file_validators_t validators;
+    file_validators(&validators, entry->ino, entry->size, &entry->mtime, entry->encoding);
+    if (request_not_modified(c, &validators)) {
+      serve_not_modified(c, &validators, entry->vary);
+      cache_release(entry);
+      free(path);
+      return;
+    }
+    if (http_request_header(request, "Range") == NULL) {
+      serve_cached(c, entry);
+      free(path);
+      return;
+    }
+    cache_release(entry);
+  }
 
   /* PART 2 & 3 BEGIN */
 
+  struct stat path_stat;
+  if (stat(path, &path_stat) == 0 && S_ISREG(path_stat.st_mode)) {
+    serve_file_or_cache(c, path, path, &path_stat);
+  } else if (stat(path, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
+    char *index_path = malloc(strlen(path) + strlen("/index.html") + 1);
+    http_format_index(index_path, path);
+    struct stat index_stat;
+    if (stat(index_path, &index_stat) == 0 && S_ISREG(index_stat.st_mode))
+      serve_file_or_cache(c, path, index_path, &index_stat);
+    else
+      serve_directory(c, path, &path_stat);
+    free(index_path);
+  } else {
+    serve_error(c, 404);
+  }
+
   /* PART 2 & 3 END */
 
-  close(fd);
-  return;
+  free(path);
 }
 
 /*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target_fd. HTTP requests from the client (fd) should be sent to the
- * proxy target (target_fd), and HTTP responses from the proxy target (target_fd)
- * should be sent to the client (fd).
- *
- *   +--------+     +------------+     +--------------+
- *   | client | <-> | httpserver | <-> | proxy target |
- *   +--------+     +------------+     +--------------+
- *
- *   Closes client socket (fd) and proxy target fd (target_fd) when finished.
+ * Step function of the files handler: reads a request, builds the response
+ * with files_respond(), then writes it out. On a persistent connection it
+ * then goes back for the next request, which may already be buffered if the
+ * client pipelined it.
  */
-void handle_proxy_request(int fd) {
+int files_step(conn_t *c) {
+  while (1) {
+    switch (c->state) {
+      case FILES_READ_REQUEST: {
+        int status = conn_read_request(c);
+        if (status <= 0) return status == 0;
+        files_respond(c);
+        c->response_built = stats_record_since(STATS_RESPOND, c->request_parsed);
+        c->state = FILES_SEND_RESPONSE;
+        break;
+      }
 
-  /*
-  * The code below does a DNS lookup of server_proxy_hostname and
-  * opens a connection to it. Please do not modify.
-  */
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
-
-  // Use DNS to resolve the proxy target's IP address
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
-
-  // Create an IPv4 TCP socket to communicate with the proxy target.
-  int target_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (target_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    close(fd);
-    exit(errno);
-  }
+      case FILES_SEND_RESPONSE: {
+        int status = conn_flush(c);
+        if (status == 0) return 1;
+        if (status < 0) return 0;
+        conn_finish_response(c);
+        if (!c->keep_alive) return 0;
+        conn_next_request(c);
+        c->state = FILES_READ_REQUEST;
+        break;
+      }
 
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    close(target_fd);
-    close(fd);
-    exit(ENXIO);
+      default:
+        return 0;
+    }
   }
+}
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
+/*
+ * Reads an HTTP request from client socket (fd), and writes an HTTP response
+ * as described in files_respond().
+ *
+ *   Closes the client socket (fd) when finished.
+ */
+void handle_files_request(int fd) {
+  conn_t *c = conn_create(fd, files_step);
+  if (c != NULL) conn_run(c);
+}
 
-  // Connect to the proxy target.
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(target_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+/* Gives up on the proxy target and answers the client with 502 instead. */
+static void proxy_fail(conn_t *c) {
+  if (c->target.fd >= 0) close(conn_detach_target(c));
+  c->state = PROXY_BAD_GATEWAY;
+}
 
-  if (connection_status < 0) {
-    /* Dummy request parsing, just to be compliant. */
-    http_request_parse(fd);
+/*
+ * Gets a connection to the proxy target (hostname=server_proxy_hostname and
+ * port=server_proxy_port), from the upstream pool if one is idle there and
+ * otherwise by connecting without blocking on the TCP handshake.
+ */
+static void proxy_connect(conn_t *c) {
+  int target_fd = c->target_retried ? -1 : upstream_acquire(&upstream);
+  c->target_pooled = target_fd >= 0;
+  c->state = PROXY_CONNECTED;
+  if (target_fd < 0) {
+    int in_progress;
+    target_fd = upstream_connect(&upstream, &in_progress);
+    if (in_progress) c->state = PROXY_CONNECTING;
+  }
+  c->target.fd = target_fd;
+  if (target_fd < 0) proxy_fail(c);
+}
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    close(target_fd);
-    close(fd);
+/*
+ * Switches to relaying raw bytes in both directions for the rest of the
+ * connection. Client bytes from SKIP onwards that are already buffered are
+ * sent ahead of anything read later.
+ */
+static void proxy_start_tunnel(conn_t *c, size_t skip) {
+  if (conn_alloc_relays(c) < 0) {
+    c->state = PROXY_DONE;
     return;
+  }
+  c->upstream->length = c->upstream->sent = 0;
+  if (skip < c->request_length) {
+    memcpy(c->upstream->data, c->request_buffer + skip, c->request_length - skip);
+    c->upstream->length = c->request_length - skip;
+  }
+  c->upstream->remaining = c->downstream->remaining = -1;
+  c->request_length = 0;
+  c->keep_alive = 0;
+  c->target_reusable = 0;
+  c->tunnel = 1;
+  c->state = PROXY_RELAY;
+}
+
+/*
+ * Returns whether the request just read can be forwarded on its own, with the
+ * target connection reused afterwards. Requests with a body, and requests that
+ * would turn the connection into something other than HTTP, are tunnelled.
+ */
+static int proxy_forwardable(struct http_request *request) {
+  return request != NULL
+      && request->content_length == 0
+      && http_request_header(request, "Transfer-Encoding") == NULL
+      && http_request_header(request, "Upgrade") == NULL
+      && strcmp(request->method, "CONNECT") != 0;
+}
+
+/*
+ * Resends the request on a new connection after a pooled one turned out to
+ * have been closed by the target before it answered. Returns -1 if the
+ * request cannot be retried.
+ */
+static int proxy_retry(conn_t *c) {
+  if (!c->target_pooled || c->downstream->length > 0) return -1;
+  close(conn_detach_target(c));
+  upstream_count_retry(&upstream);
+  c->target_retried = 1;
+  c->state = PROXY_CONNECT;
+  return 0;
+}
 
+/*
+ * Reads the target's response headers into the downstream buffer and decides
+ * how to forward the response. Returns 1 while waiting for the target.
+ */
+static int proxy_read_response(conn_t *c) {
+  conn_relay_t *r = c->downstream;
+  ssize_t bytes_read = read(c->target.fd, r->data + r->length, sizeof(r->data) - r->length);
+  if (bytes_read < 0 && errno == EINTR) return 0;
+  if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    c->target.events = POLLIN;
+    return 1;
+  }
+  c->target.events = 0;
+  if (bytes_read <= 0) {
+    if (proxy_retry(c) == 0) return 0;
+    if (r->length == 0) proxy_fail(c);
+    else proxy_start_tunnel(c, c->request->length);
+    return 0;
   }
+  r->length += bytes_read;
+
+  struct http_response_head head;
+  int status = http_response_head_parse(r->data, r->length, &head);
+  if (status == HTTP_PARSE_NEED_MORE && r->length < sizeof(r->data)) return 0;
+
+  /* Responses without a known length run until the target closes, so the
+   * target cannot be reused and neither can the client connection. */
+  long body_length = head.content_length;
+  if (strncmp(c->request_buffer, "HEAD ", 5) == 0 || head.status_code / 100 == 1
+      || head.status_code == 204 || head.status_code == 304)
+    body_length = 0;
+  if (status != HTTP_PARSE_COMPLETE || head.chunked || body_length < 0
+      || head.length + body_length < r->length) {
+    proxy_start_tunnel(c, c->request->length);
+    return 0;
+  }
+
+  stats_count_status(head.status_code);
+  c->log.status = head.status_code;
+  c->log.bytes = head.length + body_length;
+  c->response_built = stats_record_since(STATS_UPSTREAM, c->request_parsed);
+  r->sent = 0;
+  r->remaining = head.length + body_length - r->length;
+  c->target_reusable = head.keep_alive;
+  c->keep_alive = c->keep_alive && head.keep_alive;
+  c->state = PROXY_SEND_RESPONSE;
+  return 0;
+}
+
+/*
+ * Step function of the proxy handler. HTTP requests from the client (fd) are
+ * sent to the proxy target (target_fd), and HTTP responses from the proxy
+ * target (target_fd) are sent to the client (fd).
+ *
+ *   +--------+     +------------+     +--------------+
+ *   | client | <-> | httpserver | <-> | proxy target |
+ *   +--------+     +------------+     +--------------+
+ *
+ * Requests are forwarded one at a time, so that once a response of known
+ * length has been passed on, the target connection can serve the next request
+ * of any client. Anything the handler cannot frame is tunnelled instead.
+ */
+int proxy_step(conn_t *c) {
+  while (1) {
+    switch (c->state) {
+      case PROXY_READ_REQUEST: {
+        int status = conn_read_request(c);
+        if (status <= 0) return status == 0;
+        int json;
+        if (stats_requested(c->request, &json)) {
+          /* Answered here rather than by the target, on a connection that
+           * then closes like after an error. */
+          c->keep_alive = 0;
+          serve_stats(c, json);
+          c->state = PROXY_SEND_ERROR;
+          break;
+        }
+        c->tunnel = !proxy_forwardable(c->request);
+        /* The parser cut the method and path out of the buffer; put them
+         * back so the request goes out exactly as it came in. */
+        http_parser_restore(&c->parser);
+        c->state = PROXY_CONNECT;
+        break;
+      }
+
+      case PROXY_CONNECT:
+        proxy_connect(c);
+        break;
+
+      case PROXY_CONNECTING: {
+        struct pollfd target_poll = { .fd = c->target.fd, .events = POLLOUT };
+        if (poll(&target_poll, 1, 0) == 0) {
+          c->client.events = 0;
+          c->target.events = POLLOUT;
+          return 1;
+        }
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        getsockopt(c->target.fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        c->target.events = 0;
+        if (error == 0)
+          c->state = PROXY_CONNECTED;
+        else
+          proxy_fail(c);
+        break;
+      }
 
-  /* TODO: PART 4 */
-  /* PART 4 BEGIN */
+      case PROXY_CONNECTED:
+        if (c->tunnel) {
+          proxy_start_tunnel(c, 0);
+          break;
+        }
+        if (conn_alloc_relays(c) < 0) return 0;
+        c->downstream->length = c->downstream->sent = 0;
+        c->forward_sent = 0;
+        c->state = PROXY_SEND_REQUEST;
+        break;
+
+      case PROXY_SEND_REQUEST: {
+        ssize_t bytes_written = write(c->target.fd, c->request_buffer + c->forward_sent,
+            c->request->length - c->forward_sent);
+        if (bytes_written < 0 && errno == EINTR) break;
+        if (bytes_written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          c->target.events = POLLOUT;
+          return 1;
+        }
+        c->target.events = 0;
+        if (bytes_written < 0) {
+          if (proxy_retry(c) < 0) proxy_fail(c);
+          break;
+        }
+        c->forward_sent += bytes_written;
+        if (c->forward_sent == c->request->length) c->state = PROXY_READ_RESPONSE;
+        break;
+      }
+
+      case PROXY_READ_RESPONSE:
+        if (proxy_read_response(c)) return 1;
+        break;
+
+      case PROXY_SEND_RESPONSE: {
+        c->client.events = c->target.events = 0;
+        int status = conn_pump(&c->target, &c->client, c->downstream);
+        if (status <= 0) return status == 0;
+
+        conn_finish_response(c);
+        int target_fd = conn_detach_target(c);
+        if (c->target_reusable)
+          upstream_release(&upstream, target_fd);
+        else
+          close(target_fd);
+        c->target_retried = 0;
+        if (!c->keep_alive) return 0;
+        conn_next_request(c);
+        c->state = PROXY_READ_REQUEST;
+        break;
+      }
+
+      case PROXY_RELAY:
+        /* PART 4 BEGIN */
+        return conn_relay(c);
+        /* PART 4 END */
+
+      case PROXY_BAD_GATEWAY:
+        c->keep_alive = 0;
+        serve_error(c, 502);
+        c->state = PROXY_SEND_ERROR;
+        break;
+
+      case PROXY_SEND_ERROR: {
+        int status = conn_flush(c);
+        if (status > 0) conn_finish_response(c);
+        return status == 0;
+      }
 
-  /* PART 4 END */
+      default:
+        return 0;
+    }
+  }
+}
 
+/*
+ * Opens a connection to the proxy target and relays traffic to/from the
+ * stream fd and the proxy target_fd, as described in proxy_step().
+ *
+ *   Closes client socket (fd) and proxy target fd (target_fd) when finished.
+ */
+void handle_proxy_request(int fd) {
+  conn_t *c = conn_create(fd, proxy_step);
+  if (c != NULL) conn_run(c);
 }
 
 #ifdef POOLSERVER
+/* Sent, without reading the request, to clients turned away because the
+ * server is overloaded. */
+static const char OVERLOADED_RESPONSE[] =
+  "HTTP/1.1 503 Service Unavailable\r\n"
+  "Content-Type: text/html\r\n"
+  "Content-Length: 0\r\n"
+  "Retry-After: 1\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+/*
+ * Answers client socket FD with 503 and closes it, for the price of a few
+ * system calls and no parsing. Whatever part of the request has already
+ * arrived is read and dropped first, because closing a socket with unread
+ * data resets the connection, which can destroy the response before the
+ * client has read it.
+ */
+static void reject_overloaded(int fd) {
+  send(fd, OVERLOADED_RESPONSE, sizeof(OVERLOADED_RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+  shutdown(fd, SHUT_WR);
+  char discard[LIBHTTP_REQUEST_MAX_SIZE];
+  recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+  close(fd);
+  stats_count_status(503);
+}
+
+static void start_worker(void (*request_handler)(int));
+
 /*
  * All worker threads will run this function until the server shutsdown.
  * Each thread should block until a new request has been received.
@@ -208,49 +1083,147 @@ void *handle_clients(void *void_request_handler) {
    * be joining on it. */
   pthread_detach(pthread_self());
 
-  /* TODO: PART 7 */
   /* PART 7 BEGIN */
 
+  stats_busy(0);
+  while (1) {
+    long waited_us;
+    pool_idle(&pool, 1);
+    int client_socket_number = wq_pop_within(&work_queue, pool.idle_timeout_ms, &waited_us);
+    pool_idle(&pool, 0);
+    if (client_socket_number < 0) {
+      if (pool_should_shrink(&pool)) break;
+      continue;
+    }
+
+    long now = stats_now_us();
+    stats_record(STATS_QUEUE, waited_us);
+    if (pool_should_grow(&pool, waited_us, now))
+      start_worker(request_handler);
+    if (codel_should_drop(&codel, waited_us, now)) {
+      stats_count(STATS_SHED);
+      reject_overloaded(client_socket_number);
+      continue;
+    }
+    stats_busy(1);
+    request_handler(client_socket_number);
+    stats_busy(0);
+  }
+
   /* PART 7 END */
+  stats_count(STATS_POOL_SHRUNK);
+  return NULL;
+}
+
+/* Adds a worker to the pool, which has already counted it. */
+static void start_worker(void (*request_handler)(int)) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, handle_clients, request_handler) != 0) {
+    perror("Failed to create worker thread");
+    pool_should_shrink(&pool);
+    return;
+  }
+  stats_count(STATS_POOL_GROWN);
+}
+
+/*
+ * Workers only see how long connections waited once they get to them, which
+ * takes a while if every one of them is stuck in a slow handler or on a
+ * persistent connection. This thread checks the head of the queue instead,
+ * every POOL_GROW_INTERVAL_US, for pools that can grow.
+ */
+void *watch_pool(void *void_request_handler) {
+  void (*request_handler)(int) = (void (*)(int)) void_request_handler;
+  pthread_detach(pthread_self());
+  while (1) {
+    usleep(POOL_GROW_INTERVAL_US);
+    if (pool_starved(&pool)
+        && pool_should_grow(&pool, wq_oldest_wait(&work_queue), stats_now_us()))
+      start_worker(request_handler);
+  }
+  return NULL;
 }
 
 /*
- * Creates `num_threads` amount of threads. Initializes the work queue.
+ * Creates `num_threads` amount of threads, which the pool may grow up to
+ * `max_threads` and shrink back from. Initializes the work queue, which takes
+ * at most `queue_limit` sockets, and the CoDel shedding policy.
  */
 void init_thread_pool(int num_threads, void (*request_handler)(int)) {
 
-  /* TODO: PART 7 */
   /* PART 7 BEGIN */
 
+  wq_init(&work_queue);
+  work_queue.limit = queue_limit;
+  codel_init(&codel, codel_target_ms * 1000);
+  pool_init(&pool, num_threads, max_threads, worker_idle_timeout_ms);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handle_clients, request_handler) != 0) {
+      perror("Failed to create worker thread");
+      exit(errno);
+    }
+  }
+  if (pool.min_threads < pool.max_threads) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watch_pool, request_handler) != 0) {
+      perror("Failed to create pool watcher thread");
+      exit(errno);
+    }
+  }
+
   /* PART 7 END */
 }
 #endif
 
+#ifdef THREADSERVER
+struct client_thread_args {
+  void (*request_handler)(int);
+  int client_socket_number;
+};
+
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Serves a single client on its own detached thread.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+void *handle_client_thread(void *void_args) {
+  struct client_thread_args *args = void_args;
+  pthread_detach(pthread_self());
+  stats_busy(1);
+  args->request_handler(args->client_socket_number);
+  free(args);
+  return NULL;
+}
+#endif
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
+/*
+ * Opens a TCP stream socket on all interfaces listening on server_port. With
+ * `reuseport` set, several sockets may listen on the port at once and the
+ * kernel spreads incoming connections across them.
+ */
+int open_server_socket(int reuseport) {
+
+  struct sockaddr_in server_address;
 
   // Creates a socket for IPv4 and TCP.
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
+  int socket_number = socket(PF_INET, SOCK_STREAM, 0);
+  if (socket_number == -1) {
     perror("Failed to create a new socket");
     exit(errno);
   }
 
   int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+  if (setsockopt(socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
         sizeof(socket_option)) == -1) {
     perror("Failed to set socket options");
     exit(errno);
   }
 
+  if (reuseport && setsockopt(socket_number, SOL_SOCKET, SO_REUSEPORT,
+        &socket_option, sizeof(socket_option)) == -1) {
+    perror("Failed to set SO_REUSEPORT");
+    exit(errno);
+  }
+
   // Setup arguments for bind()
   memset(&server_address, 0, sizeof(server_address));
   server_address.sin_family = AF_INET;
@@ -258,17 +1231,687 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
   server_address.sin_port = htons(server_port);
 
   /*
-   * TODO: PART 1
-   *
    * Given the socket created above, call bind() to give it
    * an address and a port. Then, call listen() with the socket.
-   * An appropriate size of the backlog is 1024, though you may
-   * play around with this value during performance testing.
    */
 
   /* PART 1 BEGIN */
 
+  if (bind(socket_number, (struct sockaddr *) &server_address,
+        sizeof(server_address)) == -1) {
+    perror("Failed to bind on socket");
+    exit(errno);
+  }
+
+  if (listen(socket_number, 1024) == -1) {
+    perror("Failed to listen on socket");
+    exit(errno);
+  }
+
   /* PART 1 END */
+
+  return socket_number;
+}
+
+#if defined(REUSEPORTSERVER) || defined(EPOLLSERVER) || defined(URINGSERVER)
+/*
+ * Pins `thread`, the `index`th worker, to a CPU of its own (wrapping around
+ * if there are more workers than CPUs), when --pin-cpus is given.
+ */
+void pin_to_cpu(pthread_t thread, int index) {
+  if (!pin_cpus) return;
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+  if (pthread_setaffinity_np(thread, sizeof(cpus), &cpus) != 0)
+    fprintf(stderr, "Failed to pin worker %d to a CPU\n", index);
+}
+#endif
+
+#ifdef REUSEPORTSERVER
+struct reuseport_worker_args {
+  int server_fd;
+  void (*request_handler)(int);
+};
+
+/*
+ * Worker thread of the reuseportserver. Accepts connections on its own
+ * SO_REUSEPORT listening socket and serves each one itself, so connection
+ * setup is spread over all workers instead of going through one acceptor.
+ */
+void *reuseport_worker(void *void_args) {
+  struct reuseport_worker_args *args = void_args;
+  struct sockaddr_in client_address;
+  socklen_t client_address_length;
+
+  stats_busy(0);
+  while (1) {
+    client_address_length = sizeof(client_address);
+    int client_socket_number = accept(args->server_fd,
+        (struct sockaddr *) &client_address, &client_address_length);
+    if (client_socket_number < 0) {
+      perror("Error accepting socket");
+      continue;
+    }
+
+    stats_busy(1);
+    args->request_handler(client_socket_number);
+    stats_busy(0);
+  }
+  return NULL;
+}
+
+/*
+ * Starts `num_threads` workers, each with its own listening socket. The
+ * calling thread becomes the first worker, on `server_fd`, and never returns.
+ */
+void init_reuseport_workers(int server_fd, void (*request_handler)(int)) {
+  for (int i = 1; i < num_threads; i++) {
+    struct reuseport_worker_args *args = malloc(sizeof(struct reuseport_worker_args));
+    args->server_fd = open_server_socket(1);
+    args->request_handler = request_handler;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, reuseport_worker, args) != 0) {
+      perror("Failed to create worker thread");
+      exit(errno);
+    }
+    pin_to_cpu(thread, i);
+    pthread_detach(thread);
+  }
+
+  struct reuseport_worker_args args = { server_fd, request_handler };
+  pin_to_cpu(pthread_self(), 0);
+  reuseport_worker(&args);
+}
+#endif
+
+#if defined(EPOLLSERVER) || defined(URINGSERVER)
+#define EPOLL_MAX_EVENTS 64
+#define EPOLL_MAX_ACCEPTS 64
+
+/*
+ * Registers the events `endpoint` is waiting for with `epoll_fd`. Endpoints
+ * that are not waiting on anything are removed entirely, so that hangups on
+ * them do not keep waking the loop. POLLIN and POLLOUT have the same values
+ * as EPOLLIN and EPOLLOUT.
+ */
+static void epoll_watch(int epoll_fd, conn_endpoint_t *endpoint) {
+  if (endpoint->fd < 0 || endpoint->events == endpoint->watched) return;
+
+  if (endpoint->events == 0) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, endpoint->fd, NULL);
+    endpoint->watched = -1;
+    return;
+  }
+
+  struct epoll_event event;
+  event.events = endpoint->events;
+  event.data.ptr = endpoint;
+  int op = endpoint->watched < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  if (epoll_ctl(epoll_fd, op, endpoint->fd, &event) == 0)
+    endpoint->watched = endpoint->events;
+}
+
+/* State of one epollserver event loop. */
+typedef struct epoll_loop {
+  int epoll_fd;
+  int server_fd;
+  conn_t *closed; // Finished connections, destroyed after each batch.
+  wheel_t timers; // Timeouts of the connections, see conn_deadline().
+} epoll_loop_t;
+
+/* Stops `endpoint`'s loop from watching it, before its descriptor is handed
+ * to another conn (see conn_detach_target()). */
+static void epoll_unwatch(conn_endpoint_t *endpoint) {
+  epoll_loop_t *loop = endpoint->conn->loop;
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, endpoint->fd, NULL);
+  endpoint->watched = -1;
+}
+
+static void epoll_close(epoll_loop_t *loop, conn_t *c) {
+  wheel_cancel(&loop->timers, &c->timer);
+  c->step = NULL;
+  c->next = loop->closed;
+  loop->closed = c;
+}
+
+/*
+ * Runs one step of `c`. Finished connections are only destroyed after the
+ * current batch of events, since later events in the batch may still point at
+ * them. Connections still waiting have their timer armed for whatever they
+ * wait on.
+ */
+static void epoll_step(epoll_loop_t *loop, conn_t *c) {
+  if (!c->step(c)) {
+    epoll_close(loop, c);
+    return;
+  }
+
+  epoll_watch(loop->epoll_fd, &c->client);
+  epoll_watch(loop->epoll_fd, &c->target);
+
+  c->timer.data = c;
+  wheel_arm(&loop->timers, &c->timer, conn_deadline(c));
+}
+
+/*
+ * Closes the connections whose timeout has passed. Returns how long
+ * epoll_wait() may sleep before the next one may expire.
+ */
+static int epoll_expire(epoll_loop_t *loop) {
+  long now = conn_now_ms();
+  wheel_timer_t *timer;
+  while ((timer = wheel_expire(&loop->timers, now)) != NULL)
+    epoll_close(loop, timer->data);
+  return wheel_timeout(&loop->timers, now);
+}
+
+static void epoll_accept(epoll_loop_t *loop) {
+  struct sockaddr_in client_address;
+  socklen_t client_address_length;
+
+  for (int i = 0; i < EPOLL_MAX_ACCEPTS; i++) {
+    client_address_length = sizeof(client_address);
+    int client_socket_number = accept(loop->server_fd,
+        (struct sockaddr *) &client_address, &client_address_length);
+    if (client_socket_number < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("Error accepting socket");
+      return;
+    }
+
+    conn_t *c = conn_create(client_socket_number, request_step);
+    if (c == NULL) continue;
+    c->loop = loop;
+    c->unwatch = epoll_unwatch;
+    epoll_step(loop, c);
+  }
+}
+
+/*
+ * Event loop run by each epollserver thread. Every loop has its own epoll
+ * instance and connections, and they share the listening socket through
+ * EPOLLEXCLUSIVE so that a new connection wakes only one of them.
+ */
+void *epoll_loop(void *void_server_fd) {
+  epoll_loop_t loop;
+  memset(&loop, 0, sizeof(loop));
+  loop.server_fd = (int) (intptr_t) void_server_fd;
+  wheel_init(&loop.timers, conn_now_ms());
+
+  loop.epoll_fd = epoll_create1(0);
+  if (loop.epoll_fd < 0) {
+    perror("Failed to create epoll instance");
+    exit(errno);
+  }
+
+  struct epoll_event server_event;
+  server_event.events = EPOLLIN | EPOLLEXCLUSIVE;
+  server_event.data.ptr = NULL;
+  if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, loop.server_fd, &server_event) < 0) {
+    perror("Failed to watch server socket");
+    exit(errno);
+  }
+
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+  while (1) {
+    int timeout = epoll_expire(&loop);
+    int num_events = 0;
+    if (loop.closed == NULL) {
+      stats_busy(0);
+      num_events = epoll_wait(loop.epoll_fd, events, EPOLL_MAX_EVENTS, timeout);
+      if (num_events < 0) {
+        if (errno == EINTR) continue;
+        perror("Failed to wait for events");
+        exit(errno);
+      }
+      stats_busy(1);
+    }
+
+    for (int i = 0; i < num_events; i++) {
+      conn_endpoint_t *endpoint = events[i].data.ptr;
+      if (endpoint == NULL)
+        epoll_accept(&loop);
+      else if (endpoint->conn->step != NULL)
+        epoll_step(&loop, endpoint->conn);
+    }
+
+    while (loop.closed != NULL) {
+      conn_t *next = loop.closed->next;
+      conn_destroy(loop.closed);
+      loop.closed = next;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Starts one event loop per core (or `num_threads` loops, if given) on the
+ * listening socket. The calling thread runs the last loop and never returns.
+ */
+void init_event_loops(int server_fd) {
+  if (set_nonblocking(server_fd) < 0) {
+    perror("Failed to make server socket non-blocking");
+    exit(errno);
+  }
+
+  int num_loops = num_threads > 0 ? num_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 1; i < num_loops; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, epoll_loop, (void *) (intptr_t) server_fd) != 0) {
+      perror("Failed to create event loop thread");
+      exit(errno);
+    }
+    pin_to_cpu(thread, i);
+    pthread_detach(thread);
+  }
+  pin_to_cpu(pthread_self(), 0);
+  epoll_loop((void *) (intptr_t) server_fd);
+}
+#endif
+
+#ifdef URINGSERVER
+#define URING_ENTRIES 4096
+
+/*
+ * What a submission was for. It is kept in the low bits of the submission's
+ * user_data, next to a pointer to the uring_conn it belongs to. The multishot
+ * accept has no conn, so its user_data is 0.
+ */
+enum {
+  URING_ACCEPT,
+  URING_RECV,
+  URING_SEND,
+  URING_POLL_CLIENT,
+  URING_POLL_TARGET,
+  URING_IGNORE, // Cancellations and poll updates, which need no handling.
+};
+#define URING_OP_MASK 7UL
+
+/* State of one uringserver event loop. */
+typedef struct uring_loop {
+  uring_t ring;
+  int server_fd;
+  wheel_t timers; // Timeouts of the connections, see conn_deadline().
+} uring_loop_t;
+
+/*
+ * A conn served by a uring loop. The files handler is driven natively: its
+ * requests are received straight into the conn's buffer and its responses
+ * sent by the ring, with only file bodies going out through conn_flush().
+ * Other handlers run their step function whenever a poll on their sockets
+ * completes, the way the epollserver runs them.
+ */
+typedef struct uring_conn {
+  conn_t *c;
+  uring_loop_t *loop;
+  int native;
+  int inflight;   // Submissions whose completion has not been seen yet.
+  int closing;
+  int recv_armed;
+  int client_eof;
+  int keep_alive; // Of the response being sent.
+  struct iovec iov[2];
+  struct msghdr message;
+} uring_conn_t;
+
+static unsigned long uring_tag(uring_conn_t *u, int op) {
+  return (unsigned long) u | op;
+}
+
+/* Returns a submission entry for operation OP of U, counted as in flight. */
+static struct io_uring_sqe *uring_sqe(uring_conn_t *u, int op, int opcode, int fd,
+    const void *addr, unsigned len) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&u->loop->ring);
+  uring_prep(sqe, opcode, fd, addr, len, 0, uring_tag(u, op));
+  u->inflight++;
+  return sqe;
+}
+
+/*
+ * Starts closing U. Operations still in flight are cancelled, and the conn
+ * is destroyed by uring_settle() once the last of them has completed.
+ */
+static void uring_close(uring_conn_t *u) {
+  if (u->closing) return;
+  u->closing = 1;
+  conn_endpoint_t *endpoints[] = { &u->c->client, &u->c->target };
+  for (int i = 0; i < 2; i++) {
+    if (endpoints[i]->fd < 0 || u->inflight == 0) continue;
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->loop->ring);
+    uring_prep(sqe, IORING_OP_ASYNC_CANCEL, endpoints[i]->fd, NULL, 0, 0, URING_IGNORE);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  }
+}
+
+/*
+ * Makes sure a poll for the events `endpoint` is waiting on is armed. A poll
+ * that is already armed has its events updated instead; one that is no
+ * longer wanted is left to complete, which only costs a spurious step.
+ */
+static void uring_watch(uring_conn_t *u, conn_endpoint_t *endpoint, int op) {
+  if (endpoint->fd < 0 || endpoint->events == 0 || endpoint->events == endpoint->watched)
+    return;
+
+  struct io_uring_sqe *sqe;
+  if (endpoint->watched <= 0) {
+    sqe = uring_sqe(u, op, IORING_OP_POLL_ADD, endpoint->fd, NULL, 0);
+  } else {
+    sqe = uring_get_sqe(&u->loop->ring);
+    uring_prep(sqe, IORING_OP_POLL_REMOVE, -1, (void *) uring_tag(u, op),
+        IORING_POLL_UPDATE_EVENTS, 0, URING_IGNORE);
+  }
+  sqe->poll32_events = endpoint->events;
+  endpoint->watched = endpoint->events;
+}
+
+/* Cancels the polls on `endpoint`, before its descriptor is handed to another
+ * conn (see conn_detach_target()). */
+static void uring_unwatch(conn_endpoint_t *endpoint) {
+  uring_conn_t *u = endpoint->conn->loop;
+  if (endpoint->watched > 0) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->loop->ring);
+    uring_prep(sqe, IORING_OP_ASYNC_CANCEL, endpoint->fd, NULL, 0, 0, URING_IGNORE);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  }
+  endpoint->watched = -1;
+}
+
+/* Receives more of the request into the conn's buffer. */
+static struct io_uring_sqe *uring_recv(uring_conn_t *u) {
+  conn_t *c = u->c;
+  if (u->recv_armed || c->request_length == LIBHTTP_REQUEST_MAX_SIZE) return NULL;
+  u->recv_armed = 1;
+  return uring_sqe(u, URING_RECV, IORING_OP_RECV, c->client.fd,
+      c->request_buffer + c->request_length, LIBHTTP_REQUEST_MAX_SIZE - c->request_length);
+}
+
+/*
+ * Sends the response headers and in-memory body. On a persistent connection
+ * with nothing more buffered, the receive of the next request is linked
+ * behind the send, so that one submission covers both.
+ */
+static void uring_send(uring_conn_t *u) {
+  conn_t *c = u->c;
+  memset(&u->message, 0, sizeof(u->message));
+  u->message.msg_iov = u->iov;
+  u->message.msg_iovlen = conn_buffers(c, u->iov);
+  struct io_uring_sqe *sqe = uring_sqe(u, URING_SEND, IORING_OP_SENDMSG, c->client.fd,
+      &u->message, 1);
+  sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL
+      | (c->file_remaining > 0 || c->parts != NULL ? MSG_MORE : 0);
+  if (u->keep_alive && c->request_length == 0 && !u->recv_armed) {
+    sqe->flags |= IOSQE_IO_LINK;
+    uring_recv(u);
+  }
+}
+
+/*
+ * Drives a conn of the files handler through the same states as
+ * files_step(), with the ring doing the socket I/O.
+ */
+static void uring_files_run(uring_conn_t *u) {
+  conn_t *c = u->c;
+  while (!u->closing) {
+    switch (c->state) {
+      case FILES_READ_REQUEST:
+        if (!conn_parse_request(c)) {
+          if (u->client_eof) {
+            uring_close(u);
+            return;
+          }
+          conn_wait_request(c);
+          c->client.events = 0;
+          uring_recv(u);
+          return;
+        }
+        files_respond(c);
+        c->response_built = stats_record_since(STATS_RESPOND, c->request_parsed);
+        c->state = FILES_SEND_RESPONSE;
+        /* The request is no longer needed, so the buffer can be readied for
+         * the next one while the response is being sent. */
+        u->keep_alive = c->keep_alive;
+        if (u->keep_alive) conn_next_request(c);
+        uring_send(u);
+        return;
+
+      case FILES_SEND_RESPONSE: {
+        /* The headers and body are out; conn_flush() sends the file that
+         * follows, if any, and tidies up. */
+        int status = conn_flush(c);
+        if (status == 0) return;
+        if (status < 0) {
+          uring_close(u);
+          return;
+        }
+        conn_finish_response(c);
+        if (!u->keep_alive) {
+          uring_close(u);
+          return;
+        }
+        c->state = FILES_READ_REQUEST;
+        break;
+      }
+
+      default:
+        uring_close(u);
+        return;
+    }
+  }
+}
+
+/* Runs one step of a conn that is not driven natively. */
+static void uring_step(uring_conn_t *u) {
+  if (!u->closing && !u->c->step(u->c)) uring_close(u);
+}
+
+/*
+ * Brings U's polls and timer up to date after it has run, and destroys it
+ * once it is closing and nothing of it is in flight anymore.
+ */
+static void uring_settle(uring_conn_t *u) {
+  conn_t *c = u->c;
+  uring_loop_t *loop = u->loop;
+  if (!u->closing) {
+    uring_watch(u, &c->client, URING_POLL_CLIENT);
+    uring_watch(u, &c->target, URING_POLL_TARGET);
+    c->timer.data = u;
+    wheel_arm(&loop->timers, &c->timer, conn_deadline(c));
+  } else {
+    wheel_cancel(&loop->timers, &c->timer);
+  }
+
+  if (u->closing && u->inflight == 0) {
+    conn_destroy(c);
+    free(u);
+  }
+}
+
+/* Closes the connections whose timeout has passed. Returns how long the loop
+ * may sleep before the next one may expire. */
+static int uring_expire(uring_loop_t *loop) {
+  long now = conn_now_ms();
+  wheel_timer_t *timer;
+  while ((timer = wheel_expire(&loop->timers, now)) != NULL) {
+    uring_conn_t *u = timer->data;
+    uring_close(u);
+    uring_settle(u);
+  }
+  return wheel_timeout(&loop->timers, now);
+}
+
+/* (Re-)arms the multishot accept, which completes once per new client. */
+static void uring_accept(uring_loop_t *loop) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&loop->ring);
+  uring_prep(sqe, IORING_OP_ACCEPT, loop->server_fd, NULL, 0, 0, URING_ACCEPT);
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void uring_accepted(uring_loop_t *loop, int client_socket_number) {
+  conn_t *c = conn_create(client_socket_number, request_step);
+  if (c == NULL) return;
+  uring_conn_t *u = calloc(1, sizeof(uring_conn_t));
+  if (u == NULL) {
+    conn_destroy(c);
+    return;
+  }
+  u->c = c;
+  u->loop = loop;
+  u->native = request_step == files_step;
+  c->loop = u;
+  c->unwatch = uring_unwatch;
+  if (u->native)
+    uring_files_run(u);
+  else
+    uring_step(u);
+  uring_settle(u);
+}
+
+/* Handles one completion. */
+static void uring_complete(uring_loop_t *loop, struct io_uring_cqe *cqe) {
+  int op = cqe->user_data & URING_OP_MASK;
+  uring_conn_t *u = (uring_conn_t *) (cqe->user_data & ~URING_OP_MASK);
+  if (op == URING_IGNORE) return;
+  if (op == URING_ACCEPT) {
+    if (cqe->res >= 0)
+      uring_accepted(loop, cqe->res);
+    else if (cqe->res != -EINTR && cqe->res != -EAGAIN)
+      fprintf(stderr, "Error accepting socket: %s\n", strerror(-cqe->res));
+    if (!(cqe->flags & IORING_CQE_F_MORE)) uring_accept(loop);
+    return;
+  }
+
+  conn_t *c = u->c;
+  u->inflight--;
+  switch (op) {
+    case URING_RECV:
+      u->recv_armed = 0;
+      if (cqe->res > 0)
+        conn_received(c, cqe->res);
+      else if (cqe->res == 0)
+        u->client_eof = 1;
+      else if (cqe->res != -ECANCELED)
+        uring_close(u);
+      if (c->state == FILES_READ_REQUEST && cqe->res != -ECANCELED) uring_files_run(u);
+      break;
+
+    case URING_SEND:
+      if (cqe->res < 0) {
+        uring_close(u);
+        break;
+      }
+      conn_buffers_sent(c, cqe->res);
+      if (conn_buffers(c, u->iov) > 0)
+        uring_send(u);
+      else
+        uring_files_run(u);
+      break;
+
+    case URING_POLL_CLIENT:
+    case URING_POLL_TARGET:
+      (op == URING_POLL_CLIENT ? &c->client : &c->target)->watched = 0;
+      if (cqe->res == -ECANCELED) break;
+      if (u->native)
+        uring_files_run(u);
+      else
+        uring_step(u);
+      break;
+  }
+  uring_settle(u);
+}
+
+/* Sets up a loop with a ring of its own, or returns NULL if io_uring cannot
+ * be used. */
+static uring_loop_t *uring_loop_create(int server_fd) {
+  uring_loop_t *loop = calloc(1, sizeof(uring_loop_t));
+  if (loop == NULL) return NULL;
+  if (uring_init(&loop->ring, URING_ENTRIES) < 0) {
+    free(loop);
+    return NULL;
+  }
+  loop->server_fd = server_fd;
+  wheel_init(&loop->timers, conn_now_ms());
+  return loop;
+}
+
+/*
+ * Event loop run by each uringserver thread. All submissions made while
+ * handling a batch of completions go to the kernel in the single
+ * io_uring_enter() that also waits for the next batch.
+ */
+static void uring_loop_run(uring_loop_t *loop) {
+  uring_accept(loop);
+  while (1) {
+    int timeout = uring_expire(loop);
+    stats_busy(0);
+    uring_submit_and_wait(&loop->ring, 1, timeout);
+    stats_busy(1);
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&loop->ring)) != NULL) {
+      struct io_uring_cqe completion = *cqe;
+      uring_cqe_seen(&loop->ring);
+      uring_complete(loop, &completion);
+    }
+  }
+}
+
+void *uring_loop(void *void_server_fd) {
+  uring_loop_t *loop = uring_loop_create((int) (intptr_t) void_server_fd);
+  if (loop == NULL) {
+    perror("Failed to set up io_uring");
+    exit(errno);
+  }
+  uring_loop_run(loop);
+  return NULL;
+}
+
+/*
+ * Starts one uring loop per core (or `num_threads` loops, if given), each
+ * with a multishot accept on the listening socket. The calling thread runs
+ * the first loop and never returns. If the kernel refuses io_uring, the
+ * epollserver's loops are run instead.
+ */
+void init_uring_loops(int server_fd) {
+  uring_loop_t *first = uring_loop_create(server_fd);
+  if (first == NULL) {
+    perror("Failed to set up io_uring, falling back to epoll");
+    init_event_loops(server_fd);
+  }
+
+  int num_loops = num_threads > 0 ? num_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 1; i < num_loops; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, uring_loop, (void *) (intptr_t) server_fd) != 0) {
+      perror("Failed to create event loop thread");
+      exit(errno);
+    }
+    pin_to_cpu(thread, i);
+    pthread_detach(thread);
+  }
+  pin_to_cpu(pthread_self(), 0);
+  uring_loop_run(first);
+}
+#endif
+
+/*
+ * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
+ * the fd number of the server socket in *socket_number. For each accepted
+ * connection, calls request_handler with the accepted fd number.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+
+  struct sockaddr_in client_address;
+  size_t client_address_length = sizeof(client_address);
+  int client_socket_number;
+
+#ifdef REUSEPORTSERVER
+  *socket_number = open_server_socket(1);
+#else
+  *socket_number = open_server_socket(0);
+#endif
   printf("Listening on port %d...\n", server_port);
 
 #ifdef POOLSERVER
@@ -279,6 +1922,27 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
   init_thread_pool(num_threads, request_handler);
 #endif
 
+#ifdef EPOLLSERVER
+  /*
+   * The event loops accept and serve connections themselves, so the
+   * accept loop below is never reached.
+   */
+  init_event_loops(*socket_number);
+#endif
+
+#ifdef URINGSERVER
+  /* Likewise, with io_uring doing the accepting. */
+  init_uring_loops(*socket_number);
+#endif
+
+#ifdef REUSEPORTSERVER
+  /*
+   * Every worker accepts on its own listening socket, so the accept
+   * loop below is never reached.
+   */
+  init_reuseport_workers(*socket_number, request_handler);
+#endif
+
   while (1) {
     client_socket_number = accept(*socket_number,
         (struct sockaddr *) &client_address,
@@ -288,10 +1952,6 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
       continue;
     }
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
-
 #ifdef BASICSERVER
     /*
      * This is a single-process, single-threaded HTTP server.
@@ -301,12 +1961,12 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
      * Only after a response has been sent to the client can
      * the server accept a new connection.
      */
+    stats_busy(1);
     request_handler(client_socket_number);
+    stats_busy(0);
 
 #elif FORKSERVER
     /*
-     * TODO: PART 5
-     *
      * When a client connection has been accepted, a new
      * process is spawned. This child process will send
      * a response to the client. Afterwards, the child
@@ -317,12 +1977,26 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
 
     /* PART 5 BEGIN */
 
+    pid_t pid = fork();
+    if (pid == 0) {
+      /* The signal thread is not carried over, so let SIGINT end the child. */
+      pthread_sigmask(SIG_UNBLOCK, &shutdown_signals, NULL);
+      close(*socket_number);
+      request_handler(client_socket_number);
+      accesslog_flush();
+      exit(EXIT_SUCCESS);
+    } else if (pid < 0) {
+      perror("Failed to fork");
+    }
+    close(client_socket_number);
+
+    /* Reap any children that have finished. */
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+
     /* PART 5 END */
 
 #elif THREADSERVER
     /*
-     * TODO: PART 6
-     *
      * When a client connection has been accepted, a new
      * thread is created. This thread will send a response
      * to the client. The main thread should continue
@@ -332,18 +2006,33 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
 
     /* PART 6 BEGIN */
 
+    struct client_thread_args *args = malloc(sizeof(struct client_thread_args));
+    args->request_handler = request_handler;
+    args->client_socket_number = client_socket_number;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, handle_client_thread, args) != 0) {
+      perror("Failed to create thread");
+      close(client_socket_number);
+      free(args);
+    }
+
     /* PART 6 END */
 #elif POOLSERVER
     /*
-     * TODO: PART 7
-     *
      * When a client connection has been accepted, add the
      * client's socket number to the work queue. A thread
      * in the thread pool will send a response to the client.
+     * If the queue is full, the client is turned away at once
+     * instead of waiting for a worker it would time out on.
      */
 
     /* PART 7 BEGIN */
 
+    if (!wq_offer(&work_queue, client_socket_number)) {
+      stats_count(STATS_REJECTED);
+      reject_overloaded(client_socket_number);
+    }
+
     /* PART 7 END */
 #endif
   }
@@ -352,17 +2041,62 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
   close(*socket_number);
 }
 
-int server_fd;
-void signal_callback_handler(int signum) {
+/*
+ * SIGINT is blocked in every thread and taken by this one with sigwait(), so
+ * that the report can take the stats and cache locks and use stdio, none of
+ * which is safe in a signal handler.
+ */
+static void *signal_thread(void *void_signals) {
+  sigset_t *signals = void_signals;
+  int signum;
+  while (sigwait(signals, &signum) != 0);
   printf("Caught signal %d: %s\n", signum, strsignal(signum));
+  if (server_files_directory != NULL) {
+    cache_stats_t stats;
+    cache_get_stats(&file_cache, &stats);
+    printf("File cache: %lu hits, %lu misses, %lu evictions, %lu invalidations, %zu bytes\n",
+        stats.hits, stats.misses, stats.evictions, stats.invalidations, stats.bytes);
+    cache_get_stats(&listing_cache, &stats);
+    printf("Listing cache: %lu hits, %lu misses, %lu evictions, %lu invalidations, %zu bytes\n",
+        stats.hits, stats.misses, stats.evictions, stats.invalidations, stats.bytes);
+  }
+  if (server_proxy_hostname != NULL) {
+    upstream_stats_t stats;
+    upstream_get_stats(&upstream, &stats);
+    printf("Upstream pool: %lu hits, %lu misses, %lu stale, %lu retries, %d idle\n",
+        stats.hits, stats.misses, stats.stale, stats.retries, stats.idle);
+    printf("Upstream DNS: %lu refreshes, %lu failures\n",
+        stats.dns_refreshes, stats.dns_failures);
+  }
+  stats_gauges_t gauges;
+  sample_gauges(&gauges);
+  stats_write(stdout, 0, &gauges);
   printf("Closing socket %d\n", server_fd);
   if (close(server_fd) < 0) perror("Failed to close server_fd (ignoring)\n");
   exit(0);
 }
 
+/* Blocks SIGINT and starts the thread that waits for it. Called before any
+ * other thread exists, so that they all inherit the mask. */
+static void start_signal_thread(void) {
+  sigemptyset(&shutdown_signals);
+  sigaddset(&shutdown_signals, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, signal_thread, &shutdown_signals) != 0) {
+    perror("Failed to start the signal thread");
+    exit(errno);
+  }
+  pthread_detach(thread);
+}
+
 char *USAGE =
-  "Usage: ./httpserver --files some_directory/ [--port 8000 --num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 [--port 8000 --num-threads 5]\n";
+  "Usage: ./httpserver --files some_directory/ [--port 8000 --num-threads 5 --cache-size 16]\n"
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 [--port 8000 --num-threads 5]\n"
+  "       [--keepalive-timeout 5 --max-requests 100 --pin-cpus]\n"
+  "       [--header-timeout 10 --body-timeout 30]\n"
+  "       [--queue-limit 1024 --codel-target 5 --max-threads 64 --worker-idle-timeout 10]\n"
+  "       [--access-log access.log --access-log-sample 0.1]\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -370,17 +2104,20 @@ void exit_with_usage() {
 }
 
 int main(int argc, char **argv) {
-  signal(SIGINT, signal_callback_handler);
+  start_signal_thread();
   signal(SIGPIPE, SIG_IGN);
 
   /* Default settings */
   server_port = 8000;
+  worker_idle_timeout_ms = 10000;
+  access_log_sample = 1;
   void (*request_handler)(int) = NULL;
 
   int i;
   for (i = 1; i < argc; i++) {
     if (strcmp("--files", argv[i]) == 0) {
       request_handler = handle_files_request;
+      request_step = files_step;
       server_files_directory = argv[++i];
       if (!server_files_directory) {
         fprintf(stderr, "Expected argument after --files\n");
@@ -388,6 +2125,7 @@ int main(int argc, char **argv) {
       }
     } else if (strcmp("--proxy", argv[i]) == 0) {
       request_handler = handle_proxy_request;
+      request_step = proxy_step;
 
       char *proxy_target = argv[++i];
       if (!proxy_target) {
@@ -417,6 +2155,79 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--cache-size", argv[i]) == 0) {
+      char *cache_size_str = argv[++i];
+      if (!cache_size_str || atol(cache_size_str) < 0) {
+        fprintf(stderr, "Expected cache size in MiB after --cache-size\n");
+        exit_with_usage();
+      }
+      cache_size = atol(cache_size_str) << 20;
+    } else if (strcmp("--keepalive-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || atoi(timeout_str) < 0) {
+        fprintf(stderr, "Expected seconds after --keepalive-timeout\n");
+        exit_with_usage();
+      }
+      conn_keepalive_timeout_ms = atoi(timeout_str) * 1000;
+    } else if (strcmp("--header-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || atoi(timeout_str) < 1) {
+        fprintf(stderr, "Expected seconds after --header-timeout\n");
+        exit_with_usage();
+      }
+      conn_header_timeout_ms = atoi(timeout_str) * 1000;
+    } else if (strcmp("--body-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || atoi(timeout_str) < 1) {
+        fprintf(stderr, "Expected seconds after --body-timeout\n");
+        exit_with_usage();
+      }
+      conn_body_timeout_ms = atoi(timeout_str) * 1000;
+    } else if (strcmp("--max-requests", argv[i]) == 0) {
+      char *max_requests_str = argv[++i];
+      if (!max_requests_str || (conn_max_requests = atoi(max_requests_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-requests\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-limit", argv[i]) == 0) {
+      char *queue_limit_str = argv[++i];
+      if (!queue_limit_str || (queue_limit = atol(queue_limit_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --queue-limit\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--codel-target", argv[i]) == 0) {
+      char *codel_target_str = argv[++i];
+      if (!codel_target_str || (codel_target_ms = atol(codel_target_str)) < 0) {
+        fprintf(stderr, "Expected milliseconds after --codel-target\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log", argv[i]) == 0) {
+      access_log_path = argv[++i];
+      if (!access_log_path) {
+        fprintf(stderr, "Expected file (or - for stdout) after --access-log\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log-sample", argv[i]) == 0) {
+      char *sample_str = argv[++i];
+      if (!sample_str || (access_log_sample = atof(sample_str)) <= 0 || access_log_sample > 1) {
+        fprintf(stderr, "Expected a fraction in (0, 1] after --access-log-sample\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-threads", argv[i]) == 0) {
+      char *max_threads_str = argv[++i];
+      if (!max_threads_str || (max_threads = atoi(max_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--worker-idle-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || atoi(timeout_str) < 1) {
+        fprintf(stderr, "Expected seconds after --worker-idle-timeout\n");
+        exit_with_usage();
+      }
+      worker_idle_timeout_ms = atoi(timeout_str) * 1000;
+    } else if (strcmp("--pin-cpus", argv[i]) == 0) {
+      pin_cpus = 1;
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -431,13 +2242,34 @@ int main(int argc, char **argv) {
     exit_with_usage();
   }
 
-#ifdef POOLSERVER
+#if defined(POOLSERVER) || defined(REUSEPORTSERVER)
   if (num_threads < 1) {
     fprintf(stderr, "Please specify \"--num-threads [N]\"\n");
     exit_with_usage();
   }
 #endif
 
+#ifdef POOLSERVER
+  if (max_threads > 0 && max_threads < num_threads) {
+    fprintf(stderr, "--max-threads must be at least --num-threads\n");
+    exit_with_usage();
+  }
+#endif
+
+  stats_init();
+  if (access_log_path != NULL && accesslog_open(access_log_path, access_log_sample) < 0) {
+    perror("Failed to open access log");
+    exit(errno);
+  }
+  cache_init(&file_cache, server_files_directory ? cache_size : 0);
+  /* Listings get a cache of their own, so that one big directory cannot
+   * evict a shard's worth of hot files. A listing may fill its whole shard:
+   * one for 10k entries is several hundred KiB. */
+  cache_init(&listing_cache, server_files_directory ? cache_size : 0);
+  listing_cache.max_entry_size = listing_cache.shard_capacity;
+  if (server_proxy_hostname != NULL)
+    upstream_init(&upstream, server_proxy_hostname, server_proxy_port);
+
   chdir(server_files_directory);
   serve_forever(&server_fd, request_handler);
 
@@ -1,70 +1,312 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "libhttp.h"
 
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
-
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
-struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
+/* States of the incremental request parser. */
+enum {
+  PARSE_METHOD,
+  PARSE_PATH,
+  PARSE_VERSION,
+  PARSE_LINE_LF,
+  PARSE_HEADER_START,
+  PARSE_HEADER_NAME,
+  PARSE_HEADER_VALUE_START,
+  PARSE_HEADER_VALUE,
+  PARSE_HEADER_LF,
+  PARSE_END_LF,
+  PARSE_DONE,
+};
+
+void http_parser_init(struct http_parser *parser) {
+  memset(parser, 0, sizeof(struct http_parser));
+  parser->state = PARSE_METHOD;
+}
+
+static int http_slice_equals(const char *data, size_t length, const char *string) {
+  return strlen(string) == length && strncasecmp(data, string, length) == 0;
+}
+
+/*
+ * Records the header whose name and value have just been parsed. Connection
+ * and Content-Length are interpreted here since they decide how the
+ * connection is framed; the first LIBHTTP_MAX_HEADERS headers are kept for
+ * http_request_header().
+ */
+static int http_parser_add_header(struct http_parser *parser, char *buffer, size_t value_end) {
+  struct http_request *request = &parser->request;
+  const char *name = buffer + parser->name_start;
+  const char *value = buffer + parser->mark;
+  size_t value_length = value_end - parser->mark;
+  while (value_length > 0 && (value[value_length - 1] == ' ' || value[value_length - 1] == '\t'))
+    value_length--;
+
+  if (http_slice_equals(name, parser->name_length, "Connection")) {
+    if (value_length >= 5 && strncasecmp(value, "close", 5) == 0)
+      request->keep_alive = 0;
+    else if (value_length >= 10 && strncasecmp(value, "keep-alive", 10) == 0)
+      request->keep_alive = 1;
+  } else if (http_slice_equals(name, parser->name_length, "Content-Length")) {
+    long content_length = 0;
+    for (size_t i = 0; i < value_length; i++) {
+      if (value[i] < '0' || value[i] > '9' || content_length > (1L << 48)) return -1;
+      content_length = content_length * 10 + (value[i] - '0');
+    }
+    request->content_length = content_length;
+  }
+
+  if (request->num_headers < LIBHTTP_MAX_HEADERS) {
+    struct http_header *header = &request->headers[request->num_headers++];
+    header->name = name;
+    header->name_length = parser->name_length;
+    header->value = value;
+    header->value_length = value_length;
+  }
+  return 0;
+}
+
+/*
+ * Parses as much of the request in BUFFER[0..LENGTH) as has not been parsed
+ * yet. Call it again with the same buffer, after appending more bytes, for as
+ * long as it returns HTTP_PARSE_NEED_MORE. Once it returns HTTP_PARSE_COMPLETE,
+ * parser->request describes the request and request.length is the number of
+ * bytes it took up.
+ *
+ * Nothing is allocated: method and path are null-terminated in place (over
+ * the delimiters that follow them) and headers point into BUFFER, so BUFFER
+ * must stay put until the request has been handled.
+ */
+int http_parser_execute(struct http_parser *parser, char *buffer, size_t length) {
+  struct http_request *request = &parser->request;
+  size_t i = parser->offset;
+
+  for (; i < length; i++) {
+    char ch = buffer[i];
+    switch (parser->state) {
+      /* Read in the HTTP method: "[A-Z]*" followed by a space. */
+      case PARSE_METHOD:
+        if (ch >= 'A' && ch <= 'Z') break;
+        if (ch != ' ' || i == 0) return HTTP_PARSE_ERROR;
+        buffer[i] = '\0';
+        request->method = buffer;
+        parser->mark = i + 1;
+        parser->state = PARSE_PATH;
+        break;
+
+      /* Read in the path: "[^ \r\n]*" */
+      case PARSE_PATH:
+        while (i < length && buffer[i] != ' ' && buffer[i] != '\r' && buffer[i] != '\n') i++;
+        if (i == length) goto need_more;
+        if (i == parser->mark) return HTTP_PARSE_ERROR;
+        ch = buffer[i];
+        parser->path_end = ch;
+        buffer[i] = '\0';
+        request->path = buffer + parser->mark;
+        parser->mark = i + 1;
+        if (ch == ' ')
+          parser->state = PARSE_VERSION;
+        else
+          parser->state = ch == '\r' ? PARSE_LINE_LF : PARSE_HEADER_START;
+        break;
+
+      /* Read in HTTP version and rest of request line. HTTP/1.1
+       * connections are persistent unless the client says otherwise. */
+      case PARSE_VERSION:
+        if (ch != '\r' && ch != '\n') break;
+        request->keep_alive = i - parser->mark >= 8
+            && strncmp(buffer + parser->mark, "HTTP/1.1", 8) == 0;
+        parser->state = ch == '\r' ? PARSE_LINE_LF : PARSE_HEADER_START;
+        break;
+
+      case PARSE_LINE_LF:
+      case PARSE_HEADER_LF:
+        if (ch != '\n') return HTTP_PARSE_ERROR;
+        parser->state = PARSE_HEADER_START;
+        break;
+
+      case PARSE_HEADER_START:
+        if (ch == '\r') {
+          parser->state = PARSE_END_LF;
+        } else if (ch == '\n') {
+          goto complete;
+        } else {
+          parser->name_start = i;
+          parser->state = PARSE_HEADER_NAME;
+        }
+        break;
+
+      case PARSE_HEADER_NAME:
+        if (ch == '\r' || ch == '\n') return HTTP_PARSE_ERROR;
+        if (ch != ':') break;
+        parser->name_length = i - parser->name_start;
+        parser->state = PARSE_HEADER_VALUE_START;
+        break;
 
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
+      case PARSE_HEADER_VALUE_START:
+        if (ch == ' ' || ch == '\t') break;
+        parser->mark = i;
+        parser->state = PARSE_HEADER_VALUE;
+        /* fall through */
+
+      case PARSE_HEADER_VALUE: {
+        char *line_end = memchr(buffer + i, '\n', length - i);
+        if (line_end == NULL) {
+          i = length;
+          goto need_more;
+        }
+        i = line_end - buffer;
+        size_t value_end = i;
+        if (value_end > parser->mark && buffer[value_end - 1] == '\r') value_end--;
+        if (http_parser_add_header(parser, buffer, value_end) < 0) return HTTP_PARSE_ERROR;
+        parser->state = PARSE_HEADER_START;
+        break;
+      }
+
+      case PARSE_END_LF:
+        if (ch != '\n') return HTTP_PARSE_ERROR;
+        goto complete;
+
+      default:
+        return HTTP_PARSE_ERROR;
+    }
+  }
+
+need_more:
+  parser->offset = i;
+  return HTTP_PARSE_NEED_MORE;
+
+complete:
+  parser->state = PARSE_DONE;
+  parser->offset = i + 1;
+  request->length = i + 1;
+  return HTTP_PARSE_COMPLETE;
+}
+
+/*
+ * Puts back the delimiters that http_parser_execute() overwrote to terminate
+ * the method and path, so that the buffer holds the request exactly as it was
+ * received (for instance, to forward it). The request's method and path are
+ * no longer usable afterwards.
+ */
+void http_parser_restore(struct http_parser *parser) {
+  struct http_request *request = &parser->request;
+  if (request->path != NULL) request->path[strlen(request->path)] = parser->path_end;
+  if (request->method != NULL) request->method[strlen(request->method)] = ' ';
+  request->method = NULL;
+  request->path = NULL;
+}
+
+/*
+ * Parses the status line and headers at the start of BUFFER[0..LENGTH).
+ * Returns HTTP_PARSE_NEED_MORE until the blank line that ends the headers
+ * has arrived, and HTTP_PARSE_ERROR if the status line is malformed.
+ */
+int http_response_head_parse(const char *buffer, size_t length,
+    struct http_response_head *head) {
+  /* Find the end of the headers first, so each line below is complete. */
+  size_t end = 0;
+  for (size_t i = 0; i < length && end == 0; i++) {
+    if (buffer[i] != '\n') continue;
+    if (i >= 1 && buffer[i - 1] == '\n') end = i + 1;
+    else if (i >= 2 && buffer[i - 1] == '\r' && buffer[i - 2] == '\n') end = i + 1;
+  }
+  if (end == 0) return HTTP_PARSE_NEED_MORE;
+
+  /* Read in the status line: "HTTP/1.x NNN reason" */
+  if (end < 12 || strncmp(buffer, "HTTP/1.", 7) != 0 || buffer[8] != ' ')
+    return HTTP_PARSE_ERROR;
+  head->keep_alive = buffer[7] == '1';
+  head->status_code = 0;
+  for (int i = 9; i < 12; i++) {
+    if (buffer[i] < '0' || buffer[i] > '9') return HTTP_PARSE_ERROR;
+    head->status_code = head->status_code * 10 + (buffer[i] - '0');
+  }
+  head->chunked = 0;
+  head->content_length = -1;
+  head->length = end;
+
+  /* Read in the headers. */
+  const char *line = memchr(buffer, '\n', end) + 1;
+  while (line < buffer + end) {
+    const char *line_end = memchr(line, '\n', buffer + end - line);
+    const char *colon = memchr(line, ':', line_end - line);
+    if (colon != NULL) {
+      const char *value = colon + 1;
+      while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+      size_t name_length = colon - line;
+      size_t value_length = line_end - value;
+      if (http_slice_equals(line, name_length, "Connection")) {
+        if (value_length >= 5 && strncasecmp(value, "close", 5) == 0)
+          head->keep_alive = 0;
+        else if (value_length >= 10 && strncasecmp(value, "keep-alive", 10) == 0)
+          head->keep_alive = 1;
+      } else if (http_slice_equals(line, name_length, "Content-Length")) {
+        head->content_length = strtol(value, NULL, 10);
+      } else if (http_slice_equals(line, name_length, "Transfer-Encoding")) {
+        head->chunked = 1;
+      }
+    }
+    line = line_end + 1;
+  }
+  return HTTP_PARSE_COMPLETE;
+}
+
+/*
+ * Returns the first header of REQUEST named NAME (case-insensitively), or NULL.
+ */
+const struct http_header *http_request_header(struct http_request *request, const char *name) {
+  for (int i = 0; i < request->num_headers; i++) {
+    const struct http_header *header = &request->headers[i];
+    if (http_slice_equals(header->name, header->name_length, name)) return header;
+  }
+  return NULL;
+}
+
+/*
+ * Reads and parses a request with a single read(). Unlike the parser above,
+ * the returned request owns copies of its method and path, and must be freed
+ * with http_request_free(). Headers are not kept.
+ */
+struct http_request *http_request_parse(int fd) {
+  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE);
   if (!read_buffer) http_fatal_error("Malloc failed");
 
   int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
-
-  char *read_start, *read_end;
-  size_t read_size;
-
-  do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
+  if (bytes_read < 0) bytes_read = 0;
 
+  struct http_parser parser;
+  http_parser_init(&parser);
+  if (http_parser_execute(&parser, read_buffer, bytes_read) != HTTP_PARSE_COMPLETE) {
     free(read_buffer);
-    return request;
-  } while (0);
+    return NULL;
+  }
 
-  /* An error occurred. */
-  free(request);
+  struct http_request *request = malloc(sizeof(struct http_request));
+  if (!request) http_fatal_error("Malloc failed");
+  *request = parser.request;
+  request->method = strdup(parser.request.method);
+  request->path = strdup(parser.request.path);
+  request->num_headers = 0;
   free(read_buffer);
-  return NULL;
+  return request;
+}
 
+void http_request_free(struct http_request *request) {
+  if (request == NULL) return;
+  free(request->method);
+  free(request->path);
+  free(request);
 }
 
 char* http_get_response_message(int status_code) {
@@ -73,6 +315,8 @@ char* http_get_response_message(int status_code) {
       return "Continue";
     case 200:
       return "OK";
+    case 206:
+      return "Partial Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -89,6 +333,12 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 416:
+      return "Range Not Satisfiable";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
     default:
       return "Internal Server Error";
   }
@@ -125,6 +375,8 @@ char *http_get_mime_type(char *file_name) {
     return "application/javascript";
   } else if (strcmp(file_extension, ".pdf") == 0) {
     return "application/pdf";
+  } else if (strcmp(file_extension, ".gz") == 0) {
+    return "application/gzip";
   } else {
     return "text/plain";
   }
@@ -150,3 +402,162 @@ void http_format_index(char *buffer, char *path) {
   int length = strlen(path) + strlen("/index.html") + 1;
   snprintf(buffer, length, "%s/index.html", path);
 }
+
+/*
+ * Puts TIME, formatted as an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT"), into
+ * the provided buffer of SIZE bytes.
+ */
+void http_format_date(char *buffer, size_t size, time_t time) {
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/*
+ * Parses the HTTP date in VALUE[0..LENGTH). Returns -1 if it is not a date in
+ * the preferred format or the older asctime() one.
+ */
+time_t http_parse_date(const char *value, size_t length) {
+  char date[64];
+  if (length >= sizeof(date)) return -1;
+  memcpy(date, value, length);
+  date[length] = '\0';
+
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  char *end = strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') {
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(date, "%a %b %e %H:%M:%S %Y", &tm);
+    if (end == NULL || *end != '\0') return -1;
+  }
+  return timegm(&tm);
+}
+
+/*
+ * Returns whether the If-None-Match style list of entity tags in
+ * LIST[0..LENGTH) contains ETAG (a quoted tag) or is "*". Tags are compared
+ * weakly, ignoring any W/ prefix.
+ */
+int http_etag_matches(const char *list, size_t length, const char *etag) {
+  size_t etag_length = strlen(etag);
+  size_t i = 0;
+  while (i < length) {
+    while (i < length && (list[i] == ' ' || list[i] == '\t' || list[i] == ',')) i++;
+    size_t start = i;
+    while (i < length && list[i] != ',') i++;
+    size_t end = i;
+    while (end > start && (list[end - 1] == ' ' || list[end - 1] == '\t')) end--;
+
+    if (end - start == 1 && list[start] == '*') return 1;
+    if (end - start >= 2 && strncmp(list + start, "W/", 2) == 0) start += 2;
+    if (end - start == etag_length && strncmp(list + start, etag, etag_length) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int http_parse_offset(const char *value, size_t length, off_t *offset) {
+  if (length == 0 || length > 18) return -1;
+  *offset = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (value[i] < '0' || value[i] > '9') return -1;
+    *offset = *offset * 10 + (value[i] - '0');
+  }
+  return 0;
+}
+
+/*
+ * Parses the Range header VALUE[0..LENGTH) against a body of SIZE bytes,
+ * putting at most MAX_RANGES satisfiable ranges into RANGES. Returns how many
+ * there are, 0 if none is satisfiable (416), or -1 if the header is malformed,
+ * has no range at all, is not in bytes, or asks for too many ranges, in which
+ * case it should be ignored and the whole body sent.
+ */
+int http_parse_ranges(const char *value, size_t length, off_t size,
+    struct http_range *ranges, int max_ranges) {
+  if (length < 6 || strncasecmp(value, "bytes=", 6) != 0) return -1;
+
+  int num_ranges = 0, num_specs = 0;
+  size_t i = 6;
+  while (i < length) {
+    while (i < length && (value[i] == ' ' || value[i] == '\t')) i++;
+    size_t start = i;
+    while (i < length && value[i] != ',') i++;
+    size_t end = i++;
+    while (end > start && (value[end - 1] == ' ' || value[end - 1] == '\t')) end--;
+    if (end == start) continue;
+    num_specs++;
+
+    const char *spec = value + start;
+    const char *dash = memchr(spec, '-', end - start);
+    if (dash == NULL) return -1;
+    size_t first_length = dash - spec;
+    size_t last_length = value + end - dash - 1;
+
+    off_t first, last;
+    if (first_length == 0) {
+      /* "-N": the last N bytes. */
+      if (http_parse_offset(dash + 1, last_length, &last) < 0) return -1;
+      if (last == 0 || size == 0) continue;
+      first = size > last ? size - last : 0;
+      last = size - 1;
+    } else {
+      if (http_parse_offset(spec, first_length, &first) < 0) return -1;
+      if (last_length == 0) {
+        last = size - 1;
+      } else {
+        if (http_parse_offset(dash + 1, last_length, &last) < 0 || last < first) return -1;
+        if (last >= size) last = size - 1;
+      }
+      if (first >= size) continue;
+    }
+
+    if (num_ranges == max_ranges) return -1;
+    ranges[num_ranges].first = first;
+    ranges[num_ranges].last = last;
+    num_ranges++;
+  }
+  return num_specs > 0 ? num_ranges : -1;
+}
+
+/*
+ * Returns whether the Accept-Encoding header VALUE[0..LENGTH) allows content
+ * coding CODING: it must be listed, or failing that "*" must be, and not with
+ * a quality of 0.
+ */
+int http_accepts_encoding(const char *value, size_t length, const char *coding) {
+  size_t coding_length = strlen(coding);
+  int star = 0;
+  size_t i = 0;
+  while (i < length) {
+    while (i < length && (value[i] == ' ' || value[i] == '\t' || value[i] == ',')) i++;
+    size_t start = i;
+    while (i < length && value[i] != ',' && value[i] != ';'
+        && value[i] != ' ' && value[i] != '\t')
+      i++;
+    size_t end = i;
+
+    /* Of the parameters, only the quality matters, and only whether it is 0. */
+    int refused = 0;
+    while (i < length && value[i] != ',') {
+      if (value[i] == ';') {
+        i++;
+        while (i < length && (value[i] == ' ' || value[i] == '\t')) i++;
+        if (i + 1 < length && (value[i] == 'q' || value[i] == 'Q') && value[i + 1] == '=') {
+          i += 2;
+          refused = i < length && value[i] == '0';
+          for (i++; i < length && value[i] != ',' && value[i] != ';'; i++)
+            if (value[i] != '.' && value[i] != '0' && value[i] != ' ') refused = 0;
+          continue;
+        }
+      }
+      i++;
+    }
+
+    if (end - start == coding_length && strncasecmp(value + start, coding, coding_length) == 0)
+      return !refused;
+    if (end - start == 1 && value[start] == '*') star = !refused;
+  }
+  return star;
+}
@@ -20,25 +20,106 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <stddef.h>
+#include <time.h>
+
+#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define LIBHTTP_MAX_HEADERS 32
+
 /*
  * Functions for parsing an HTTP request.
  */
+struct http_header {
+  const char *name;  // Not null-terminated.
+  size_t name_length;
+  const char *value; // Not null-terminated.
+  size_t value_length;
+};
+
 struct http_request {
   char *method;
   char *path;
+  int keep_alive;      // Whether the client wants the connection kept open.
+  long content_length; // Length of the request body, if any.
+  size_t length;       // Length of the request line and headers.
+  int num_headers;
+  struct http_header headers[LIBHTTP_MAX_HEADERS];
 };
 
 struct http_request *http_request_parse(int fd);
+void http_request_free(struct http_request *request);
+const struct http_header *http_request_header(struct http_request *request, const char *name);
+
+/*
+ * Incremental request parser. Feed it a buffer that grows as bytes arrive:
+ *
+ *     struct http_parser parser;
+ *     http_parser_init(&parser);
+ *     while (http_parser_execute(&parser, buffer, length) == HTTP_PARSE_NEED_MORE)
+ *       length += read(fd, buffer + length, size - length);
+ *
+ * and use parser.request once it returns HTTP_PARSE_COMPLETE.
+ */
+#define HTTP_PARSE_ERROR -1
+#define HTTP_PARSE_NEED_MORE 0
+#define HTTP_PARSE_COMPLETE 1
+
+struct http_parser {
+  int state;
+  size_t offset;      // Bytes of the buffer parsed so far.
+  size_t mark;        // Start of the token being parsed.
+  size_t name_start;  // Name of the header being parsed.
+  size_t name_length;
+  char path_end;      // Delimiter overwritten by the path's terminator.
+  struct http_request request;
+};
+
+void http_parser_init(struct http_parser *parser);
+int http_parser_execute(struct http_parser *parser, char *buffer, size_t length);
+void http_parser_restore(struct http_parser *parser);
+
+/*
+ * Functions for reading an HTTP response, as a proxy does. Only what is
+ * needed to find the end of the response is kept.
+ */
+struct http_response_head {
+  int status_code;
+  int keep_alive;      // Whether the server will keep the connection open.
+  int chunked;         // Whether the body uses a transfer encoding.
+  long content_length; // -1 when the response has no Content-Length.
+  size_t length;       // Length of the status line and headers.
+};
+
+int http_response_head_parse(const char *buffer, size_t length,
+    struct http_response_head *head);
 
 /*
  * Functions for sending an HTTP response.
  */
+char *http_get_response_message(int status_code);
 void http_start_response(int fd, int status_code);
 void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_format_href(char *buffer, char *path, char *filename);
 void http_format_index(char *buffer, char *path);
 
+/*
+ * Functions for conditional, range and content-negotiated requests.
+ */
+#define LIBHTTP_MAX_RANGES 16
+
+struct http_range {
+  off_t first;
+  off_t last;   // Inclusive, as in the Range header.
+};
+
+void http_format_date(char *buffer, size_t size, time_t time);
+time_t http_parse_date(const char *value, size_t length);
+int http_etag_matches(const char *list, size_t length, const char *etag);
+int http_parse_ranges(const char *value, size_t length, off_t size,
+    struct http_range *ranges, int max_ranges);
+int http_accepts_encoding(const char *value, size_t length, const char *coding);
+
 /*
  * Helper function: gets the Content-Type based on a file name.
  */
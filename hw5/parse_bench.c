@@ -0,0 +1,90 @@
+/*
+ * Microbenchmark for the incremental request parser in libhttp.
+ *
+ * Usage: ./parse_bench [iterations]
+ *
+ * Parses a typical browser request over and over, first handed to the parser
+ * whole and then trickled in small chunks the way a slow client would send
+ * it, and reports requests parsed per second for each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhttp.h"
+
+static const char *REQUEST =
+  "GET /my_documents/WEB_SCALE.jpg HTTP/1.1\r\n"
+  "Host: localhost:8000\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:84.0) Gecko/20100101 Firefox/84.0\r\n"
+  "Accept: image/webp,*/*\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Connection: keep-alive\r\n"
+  "Referer: http://localhost:8000/\r\n"
+  "Cache-Control: max-age=0\r\n"
+  "\r\n";
+
+static double now_seconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Parses the request `iterations` times, revealing `chunk` more bytes to the
+ * parser on each call. Returns requests per second.
+ */
+static double bench(long iterations, size_t chunk) {
+  size_t request_length = strlen(REQUEST);
+  char buffer[LIBHTTP_REQUEST_MAX_SIZE];
+  struct http_parser parser;
+  long checksum = 0;
+
+  double start = now_seconds();
+  for (long i = 0; i < iterations; i++) {
+    /* The parser writes into the buffer, as it would into a conn's. */
+    memcpy(buffer, REQUEST, request_length);
+    http_parser_init(&parser);
+    size_t length = 0;
+    int status = HTTP_PARSE_NEED_MORE;
+    while (status == HTTP_PARSE_NEED_MORE && length < request_length) {
+      length += chunk;
+      if (length > request_length) length = request_length;
+      status = http_parser_execute(&parser, buffer, length);
+    }
+    if (status != HTTP_PARSE_COMPLETE) {
+      fprintf(stderr, "Parse failed\n");
+      exit(1);
+    }
+    checksum += parser.request.num_headers + parser.request.keep_alive;
+  }
+  double elapsed = now_seconds() - start;
+
+  if (checksum != iterations * 9) {
+    fprintf(stderr, "Unexpected parse result\n");
+    exit(1);
+  }
+  return iterations / elapsed;
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+  size_t request_length = strlen(REQUEST);
+
+  size_t chunks[] = { request_length, 64, 16, 1 };
+  printf("%-12s %14s %10s\n", "chunk", "requests/s", "MB/s");
+  for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+    long n = chunks[i] == 1 ? iterations / 8 : iterations;
+    double rate = bench(n, chunks[i]);
+    char label[32];
+    if (chunks[i] == request_length)
+      snprintf(label, sizeof(label), "whole (%zu)", request_length);
+    else
+      snprintf(label, sizeof(label), "%zu bytes", chunks[i]);
+    printf("%-12s %14.0f %10.1f\n", label, rate, rate * request_length / 1e6);
+  }
+  return 0;
+}
@@ -0,0 +1,61 @@
+#include <string.h>
+
+#include "pool.h"
+
+void pool_init(pool_t *pool, int min_threads, int max_threads, long idle_timeout_ms) {
+  memset(pool, 0, sizeof(pool_t));
+  pool->min_threads = min_threads;
+  pool->max_threads = max_threads > min_threads ? max_threads : min_threads;
+  pool->idle_timeout_ms = pool->min_threads < pool->max_threads ? idle_timeout_ms : -1;
+  pool->threads = min_threads;
+}
+
+/*
+ * Called with how long the oldest connection has waited (or did wait) in the
+ * work queue. Returns whether the caller should start another worker, in
+ * which case it has already been counted. Short waits cost a single load.
+ */
+int pool_should_grow(pool_t *pool, long waited_us, long now_us) {
+  if (waited_us < POOL_GROW_WAIT_US || pool->min_threads == pool->max_threads)
+    return 0;
+
+  long last = __atomic_load_n(&pool->last_grow_us, __ATOMIC_RELAXED);
+  if (now_us - last < POOL_GROW_INTERVAL_US) return 0;
+  int threads = __atomic_load_n(&pool->threads, __ATOMIC_RELAXED);
+  if (threads >= pool->max_threads) return 0;
+  /* Only one of the threads racing here wins the interval, and it then
+   * claims a slot under the maximum. */
+  if (!__atomic_compare_exchange_n(&pool->last_grow_us, &last, now_us, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    return 0;
+  while (threads < pool->max_threads) {
+    if (__atomic_compare_exchange_n(&pool->threads, &threads, threads + 1, 0,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+  }
+  return 0;
+}
+
+/* Called by a worker that has been idle for the idle timeout. Returns whether
+ * it should exit, in which case it is no longer counted. */
+int pool_should_shrink(pool_t *pool) {
+  int threads = __atomic_load_n(&pool->threads, __ATOMIC_RELAXED);
+  while (threads > pool->min_threads) {
+    if (__atomic_compare_exchange_n(&pool->threads, &threads, threads - 1, 0,
+          __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      return 1;
+  }
+  return 0;
+}
+
+/* Marks a worker as waiting on the work queue (IDLE) or not. */
+void pool_idle(pool_t *pool, int idle) {
+  __atomic_add_fetch(&pool->idle, idle ? 1 : -1, __ATOMIC_RELAXED);
+}
+
+/* Whether a connection queued now would have to wait for a worker: none is
+ * idle, and the pool could still grow. */
+int pool_starved(pool_t *pool) {
+  return __atomic_load_n(&pool->idle, __ATOMIC_RELAXED) <= 0
+      && __atomic_load_n(&pool->threads, __ATOMIC_RELAXED) < pool->max_threads;
+}
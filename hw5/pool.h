@@ -0,0 +1,36 @@
+#ifndef __POOL__
+#define __POOL__
+
+/* POOL decides when the POOLSERVER adds and retires workers. The pool starts
+ * with its minimum number of workers. When connections wait in the work queue
+ * for longer than POOL_GROW_WAIT_US, every worker is tied up, typically in a
+ * handler that blocks on the disk or the proxy target, and another worker is
+ * started, at most one every POOL_GROW_INTERVAL_US and never more than the
+ * maximum. Waits are reported by workers as they take connections and by a
+ * watcher that looks at the head of the queue, for when no worker does. A
+ * worker that finds nothing to do for the idle timeout exits, as long as the
+ * pool stays at its minimum or above. With the minimum equal to the maximum,
+ * the pool is fixed in size.
+ *
+ * The pool only keeps the counts; starting and stopping threads is up to the
+ * caller. */
+
+#define POOL_GROW_WAIT_US 1000
+#define POOL_GROW_INTERVAL_US 5000
+
+typedef struct pool {
+  int min_threads;
+  int max_threads;
+  long idle_timeout_ms; // -1 when the pool is fixed in size.
+  int threads;       // Workers running or being started.
+  int idle;          // Workers waiting on the work queue.
+  long last_grow_us; // When the last worker was added.
+} pool_t;
+
+void pool_init(pool_t *pool, int min_threads, int max_threads, long idle_timeout_ms);
+int pool_should_grow(pool_t *pool, long waited_us, long now_us);
+int pool_should_shrink(pool_t *pool);
+void pool_idle(pool_t *pool, int idle);
+int pool_starved(pool_t *pool);
+
+#endif
@@ -0,0 +1,33 @@
+#!/bin/bash
+#
+# Writes a gzip sidecar, FILE.gz, next to every text file under the given
+# directories whose sidecar is missing or older than the file. The files
+# handler sends the sidecar instead of the file to clients that accept gzip,
+# so nothing is compressed per request. Sidecars that would not save at least
+# a tenth of the file are not kept, and stale ones are removed.
+#
+# Usage: ./precompress.sh [DIRECTORY...]   (or: make precompress, for www)
+#
+# Run it before starting the server, and again after editing files: until
+# then, the server sends edited files uncompressed rather than trust an old
+# sidecar. A running server may keep doing so while the file stays in its
+# cache.
+
+cd "$(dirname "$0")"
+
+find "${@:-www}" -type f \( -name '*.html' -o -name '*.htm' -o -name '*.css' \
+    -o -name '*.js' -o -name '*.txt' \) -print0 |
+while IFS= read -r -d '' file; do
+  sidecar="$file.gz"
+  [ -e "$sidecar" ] && ! [ "$file" -nt "$sidecar" ] && continue
+  # Written aside and renamed into place, so that the server never reads a
+  # half-written sidecar and sees a new one as a different file.
+  gzip -9 -n -c "$file" > "$sidecar.tmp"
+  if [ $(( $(stat -c %s "$sidecar.tmp") * 10 )) -gt $(( $(stat -c %s "$file") * 9 )) ]; then
+    rm -f "$sidecar.tmp" "$sidecar"
+  else
+    touch -r "$file" "$sidecar.tmp"
+    mv -f "$sidecar.tmp" "$sidecar"
+    echo "$sidecar"
+  fi
+done
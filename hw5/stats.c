@@ -0,0 +1,258 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "utlist.h"
+
+static const char *STAGE_NAMES[STATS_NUM_STAGES] = {
+  "queue", "parse", "respond", "upstream", "send", "total",
+};
+
+static const char *COUNTER_NAMES[STATS_NUM_COUNTERS] = {
+  "connections_opened", "connections_closed", "requests",
+  "responses_1xx", "responses_2xx", "responses_3xx", "responses_4xx", "responses_5xx",
+  "rejected", "shed", "pool_grown", "pool_shrunk", "log_dropped",
+};
+
+static const double PERCENTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char *PERCENTILE_NAMES[] = { "p50_us", "p90_us", "p99_us", "p999_us" };
+#define NUM_PERCENTILES (sizeof(PERCENTILES) / sizeof(PERCENTILES[0]))
+
+/* The mutex only guards the list of blocks and the retired block: it is
+ * taken when a thread records for the first time, when it exits, and for
+ * reports, never for recording. */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static stats_thread_t *stats_threads; // Blocks of live threads.
+static stats_thread_t stats_retired;  // Sum of the blocks of exited threads.
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static __thread stats_thread_t *stats_self;
+static long stats_started_us;
+
+/* Microseconds on a monotonic clock. */
+long stats_now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void stats_init(void) {
+  stats_started_us = stats_now_us();
+}
+
+/* Values are only ever written by the thread owning them, so a relaxed store
+ * of the incremented value is enough; the atomic accesses just keep readers
+ * from seeing torn values. */
+static void stats_add(unsigned long *value, unsigned long n) {
+  __atomic_store_n(value, *value + n, __ATOMIC_RELAXED);
+}
+
+static unsigned long stats_load(unsigned long *value) {
+  return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+/* Adds the histograms and counters of FROM to INTO. */
+static void stats_merge(stats_thread_t *into, stats_thread_t *from) {
+  for (int stage = 0; stage < STATS_NUM_STAGES; stage++) {
+    stats_histogram_t *to = &into->stages[stage], *h = &from->stages[stage];
+    for (int i = 0; i < STATS_BUCKETS; i++)
+      to->counts[i] += stats_load(&h->counts[i]);
+    to->count += stats_load(&h->count);
+    to->sum += stats_load(&h->sum);
+    unsigned long max = stats_load(&h->max);
+    if (max > to->max) to->max = max;
+  }
+  for (int i = 0; i < STATS_NUM_COUNTERS; i++)
+    into->counters[i] += stats_load(&from->counters[i]);
+}
+
+/* Called when a thread that has recorded something exits. */
+static void stats_retire(void *void_self) {
+  stats_thread_t *self = void_self;
+  pthread_mutex_lock(&stats_mutex);
+  stats_merge(&stats_retired, self);
+  DL_DELETE(stats_threads, self);
+  pthread_mutex_unlock(&stats_mutex);
+  free(self);
+}
+
+static void stats_create_key(void) {
+  pthread_key_create(&stats_key, stats_retire);
+}
+
+/* Returns the calling thread's block, creating it on first use. */
+static stats_thread_t *stats_local(void) {
+  if (stats_self != NULL) return stats_self;
+
+  pthread_once(&stats_key_once, stats_create_key);
+  stats_thread_t *self = calloc(1, sizeof(stats_thread_t));
+  if (self == NULL) {
+    fprintf(stderr, "Malloc failed\n");
+    exit(ENOBUFS);
+  }
+  pthread_mutex_lock(&stats_mutex);
+  DL_APPEND(stats_threads, self);
+  pthread_mutex_unlock(&stats_mutex);
+  pthread_setspecific(stats_key, self);
+  stats_self = self;
+  return self;
+}
+
+/* Index of the bucket holding VALUE. Values below 2 * STATS_SUB_BUCKETS get
+ * a bucket each; above that, the top STATS_SUB_BUCKET_BITS + 1 bits of the
+ * value pick the bucket. */
+static int stats_bucket(unsigned long value) {
+  if (value >= 1UL << STATS_MAX_BITS) value = (1UL << STATS_MAX_BITS) - 1;
+  if (value < 2 * STATS_SUB_BUCKETS) return value;
+  int shift = 63 - __builtin_clzl(value) - STATS_SUB_BUCKET_BITS;
+  return shift * STATS_SUB_BUCKETS + (value >> shift);
+}
+
+/* Largest value that falls in bucket INDEX. */
+static unsigned long stats_bucket_high(int index) {
+  if (index < 2 * STATS_SUB_BUCKETS) return index;
+  int shift = index / STATS_SUB_BUCKETS - 1;
+  unsigned long base = index - shift * STATS_SUB_BUCKETS;
+  return ((base + 1) << shift) - 1;
+}
+
+/* Adds DURATION_US to the histogram of STAGE. */
+void stats_record(int stage, long duration_us) {
+  if (duration_us < 0) duration_us = 0;
+  stats_histogram_t *h = &stats_local()->stages[stage];
+  stats_add(&h->counts[stats_bucket(duration_us)], 1);
+  stats_add(&h->count, 1);
+  stats_add(&h->sum, duration_us);
+  if ((unsigned long) duration_us > h->max)
+    __atomic_store_n(&h->max, duration_us, __ATOMIC_RELAXED);
+}
+
+/* Records the time since START_US, a stats_now_us() timestamp, for STAGE.
+ * Nothing is recorded if START_US is 0. Returns the current time, so that
+ * consecutive stages can be chained. */
+long stats_record_since(int stage, long start_us) {
+  long now = stats_now_us();
+  if (start_us > 0) stats_record(stage, now - start_us);
+  return now;
+}
+
+void stats_count(int counter) {
+  stats_add(&stats_local()->counters[counter], 1);
+}
+
+/* Counts a response by the class of STATUS_CODE. */
+void stats_count_status(int status_code) {
+  int class = status_code / 100;
+  if (class >= 1 && class <= 5)
+    stats_count(STATS_RESPONSES_1XX + class - 1);
+}
+
+/* Marks the calling thread as a worker that is (BUSY) or is not serving a
+ * connection, for the active worker count. */
+void stats_busy(int busy) {
+  stats_thread_t *self = stats_local();
+  self->worker = 1;
+  __atomic_store_n(&self->busy, busy, __ATOMIC_RELAXED);
+}
+
+/* Value at or below which a fraction P of the recorded values lie. */
+static unsigned long stats_percentile(stats_histogram_t *h, double p) {
+  if (h->count == 0) return 0;
+  unsigned long rank = (unsigned long) (p * h->count + 0.5);
+  if (rank < 1) rank = 1;
+  unsigned long seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) {
+      unsigned long high = stats_bucket_high(i);
+      return high < h->max ? high : h->max;
+    }
+  }
+  return h->max;
+}
+
+static void stats_write_gauge(FILE *out, int json, const char *name, long value,
+    int *first) {
+  if (json) {
+    fprintf(out, "%s\"%s\":", *first ? "" : ",", name);
+    if (value < 0)
+      fprintf(out, "null");
+    else
+      fprintf(out, "%ld", value);
+  } else if (value >= 0) {
+    fprintf(out, "%s: %ld\n", name, value);
+  }
+  *first = 0;
+}
+
+/*
+ * Writes a report of everything recorded so far to OUT, as plain text or, if
+ * JSON is set, as a JSON object. GAUGES holds what the caller sampled.
+ */
+void stats_write(FILE *out, int json, stats_gauges_t *gauges) {
+  stats_thread_t *total = calloc(1, sizeof(stats_thread_t));
+  if (total == NULL) {
+    fprintf(stderr, "Malloc failed\n");
+    exit(ENOBUFS);
+  }
+  long workers = 0, active_workers = 0;
+  pthread_mutex_lock(&stats_mutex);
+  stats_merge(total, &stats_retired);
+  stats_thread_t *t;
+  DL_FOREACH(stats_threads, t) {
+    stats_merge(total, t);
+    workers += __atomic_load_n(&t->worker, __ATOMIC_RELAXED);
+    active_workers += __atomic_load_n(&t->busy, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&stats_mutex);
+
+  double uptime = (stats_now_us() - stats_started_us) / 1e6;
+  long open_connections = total->counters[STATS_CONNECTIONS_OPENED]
+      - total->counters[STATS_CONNECTIONS_CLOSED];
+
+  if (json) fprintf(out, "{\"uptime_seconds\":%.3f,\"counters\":{", uptime);
+  else fprintf(out, "uptime_seconds: %.3f\n", uptime);
+  for (int i = 0; i < STATS_NUM_COUNTERS; i++) {
+    if (json) fprintf(out, "%s\"%s\":%lu", i ? "," : "", COUNTER_NAMES[i], total->counters[i]);
+    else fprintf(out, "%s: %lu\n", COUNTER_NAMES[i], total->counters[i]);
+  }
+
+  int first = 1;
+  if (json) fprintf(out, "},\"gauges\":{");
+  stats_write_gauge(out, json, "open_connections", open_connections, &first);
+  stats_write_gauge(out, json, "workers", workers, &first);
+  stats_write_gauge(out, json, "active_workers", active_workers, &first);
+  stats_write_gauge(out, json, "queue_depth", gauges->queue_depth, &first);
+  stats_write_gauge(out, json, "accept_backlog", gauges->accept_backlog, &first);
+
+  if (json) {
+    fprintf(out, "},\"stages\":{");
+  } else {
+    fprintf(out, "\n%-10s %10s %10s", "stage", "count", "mean_us");
+    for (size_t p = 0; p < NUM_PERCENTILES; p++)
+      fprintf(out, " %10s", PERCENTILE_NAMES[p]);
+    fprintf(out, " %10s\n", "max_us");
+  }
+  for (int stage = 0; stage < STATS_NUM_STAGES; stage++) {
+    stats_histogram_t *h = &total->stages[stage];
+    double mean = h->count ? (double) h->sum / h->count : 0;
+    if (json)
+      fprintf(out, "%s\"%s\":{\"count\":%lu,\"mean_us\":%.1f", stage ? "," : "",
+          STAGE_NAMES[stage], h->count, mean);
+    else
+      fprintf(out, "%-10s %10lu %10.1f", STAGE_NAMES[stage], h->count, mean);
+    for (size_t p = 0; p < NUM_PERCENTILES; p++) {
+      unsigned long value = stats_percentile(h, PERCENTILES[p]);
+      if (json) fprintf(out, ",\"%s\":%lu", PERCENTILE_NAMES[p], value);
+      else fprintf(out, " %10lu", value);
+    }
+    if (json) fprintf(out, ",\"max_us\":%lu}", h->max);
+    else fprintf(out, " %10lu\n", h->max);
+  }
+  if (json) fprintf(out, "}}\n");
+
+  free(total);
+}
@@ -0,0 +1,81 @@
+#ifndef __STATS__
+#define __STATS__
+
+#include <stdio.h>
+
+/* STATS keeps latency histograms for each stage a request goes through, and
+ * a few counters, so that /__stats can tell where a slow server spends its
+ * time. Every thread records into a block of its own, which only it writes,
+ * so the hot path takes no locks and shares no cache lines; a report adds
+ * the blocks up. A thread's block is folded into a shared one when the
+ * thread exits.
+ *
+ * Histograms are log-linear, in the style of HdrHistogram: each power of two
+ * of microseconds is split into STATS_SUB_BUCKETS equal buckets, which keeps
+ * every recorded value within about 6% whatever its magnitude. */
+
+#define STATS_SUB_BUCKET_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_MAX_BITS 40 // Longer durations (~12 days) are clamped.
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BUCKET_BITS + 1) * STATS_SUB_BUCKETS)
+
+enum {
+  STATS_QUEUE,    // Accepted socket waiting in the work queue for a worker.
+  STATS_PARSE,    // First byte of a request read until it is fully parsed.
+  STATS_RESPOND,  // Building the response: cache and filesystem access.
+  STATS_UPSTREAM, // Proxy: request parsed until the target's response head.
+  STATS_SEND,     // Response built until its last byte is written.
+  STATS_TOTAL,    // First byte of a request read until the response is sent.
+  STATS_NUM_STAGES,
+};
+
+enum {
+  STATS_CONNECTIONS_OPENED,
+  STATS_CONNECTIONS_CLOSED,
+  STATS_REQUESTS,
+  STATS_RESPONSES_1XX,
+  STATS_RESPONSES_2XX,
+  STATS_RESPONSES_3XX,
+  STATS_RESPONSES_4XX,
+  STATS_RESPONSES_5XX,
+  STATS_REJECTED, // Turned away by the acceptor because the work queue was full.
+  STATS_SHED,     // Dropped by CoDel after waiting too long in the queue.
+  STATS_POOL_GROWN,  // Workers added because connections waited too long.
+  STATS_POOL_SHRUNK, // Workers retired after sitting idle.
+  STATS_LOG_DROPPED, // Access log entries lost to a full ring.
+  STATS_NUM_COUNTERS,
+};
+
+typedef struct stats_histogram {
+  unsigned long counts[STATS_BUCKETS];
+  unsigned long count;
+  unsigned long sum;
+  unsigned long max;
+} stats_histogram_t;
+
+typedef struct stats_thread {
+  stats_histogram_t stages[STATS_NUM_STAGES];
+  unsigned long counters[STATS_NUM_COUNTERS];
+  int worker; // Set once the thread has reported itself busy or idle.
+  int busy;   // Serving a connection right now.
+  struct stats_thread *next;
+  struct stats_thread *prev;
+} stats_thread_t;
+
+/* Values the server samples at report time, or -1 where they do not apply to
+ * the server mode. */
+typedef struct stats_gauges {
+  long queue_depth;    // Accepted sockets waiting for a pool worker.
+  long accept_backlog; // Connections waiting in the kernel's accept queue.
+} stats_gauges_t;
+
+void stats_init(void);
+long stats_now_us(void);
+void stats_record(int stage, long duration_us);
+long stats_record_since(int stage, long start_us);
+void stats_count(int counter);
+void stats_count_status(int status_code);
+void stats_busy(int busy);
+void stats_write(FILE *out, int json, stats_gauges_t *gauges);
+
+#endif
@@ -0,0 +1,183 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "upstream.h"
+
+static time_t upstream_now(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec;
+}
+
+/* Looks up UPSTREAM's hostname. Returns -1 if it cannot be resolved.
+ * getaddrinfo() is used because, unlike gethostbyname2(), it is safe to call
+ * while workers are running. */
+static int upstream_resolve(upstream_t *upstream, struct sockaddr_in *address) {
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(upstream->hostname, NULL, &hints, &result) != 0) return -1;
+  memcpy(address, result->ai_addr, sizeof(*address));
+  address->sin_port = htons(upstream->port);
+  freeaddrinfo(result);
+  return 0;
+}
+
+/* Closes every pooled connection. UPSTREAM must be locked. */
+static void upstream_drain(upstream_t *upstream) {
+  while (upstream->num_idle > 0)
+    close(upstream->idle[--upstream->num_idle].fd);
+}
+
+/* Re-resolves the target every UPSTREAM_DNS_REFRESH seconds. The last good
+ * address is kept if a lookup fails. */
+static void *upstream_refresh(void *void_upstream) {
+  upstream_t *upstream = void_upstream;
+  while (1) {
+    sleep(UPSTREAM_DNS_REFRESH);
+    struct sockaddr_in address;
+    if (upstream_resolve(upstream, &address) < 0) {
+      __atomic_add_fetch(&upstream->dns_failures, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    __atomic_add_fetch(&upstream->dns_refreshes, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&upstream->mutex);
+    if (memcmp(&address.sin_addr, &upstream->address.sin_addr, sizeof(address.sin_addr)) != 0) {
+      /* Pooled connections still lead to the old address. */
+      upstream->address = address;
+      upstream_drain(upstream);
+    }
+    pthread_mutex_unlock(&upstream->mutex);
+  }
+  return NULL;
+}
+
+/* Resolves HOSTNAME and starts the thread that keeps the result fresh. Exits
+ * if HOSTNAME cannot be resolved at all. */
+void upstream_init(upstream_t *upstream, char *hostname, int port) {
+  memset(upstream, 0, sizeof(upstream_t));
+  pthread_mutex_init(&upstream->mutex, NULL);
+  upstream->hostname = hostname;
+  upstream->port = port;
+  if (upstream_resolve(upstream, &upstream->address) < 0) {
+    fprintf(stderr, "Cannot find host: %s\n", hostname);
+    exit(ENXIO);
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, upstream_refresh, upstream) != 0) {
+    perror("Failed to create DNS refresh thread");
+    exit(errno);
+  }
+  pthread_detach(thread);
+}
+
+/* Copies the target's current address into ADDRESS. */
+void upstream_address(upstream_t *upstream, struct sockaddr_in *address) {
+  pthread_mutex_lock(&upstream->mutex);
+  *address = upstream->address;
+  pthread_mutex_unlock(&upstream->mutex);
+}
+
+/* Returns whether pooled connection FD can still carry a request: the target
+ * must not have closed it, nor sent anything while it sat in the pool. */
+static int upstream_alive(int fd) {
+  char byte;
+  ssize_t peeked = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Takes an idle connection out of the pool. Returns -1 if there is none, in
+ * which case the caller should upstream_connect(). */
+int upstream_acquire(upstream_t *upstream) {
+  time_t now = upstream_now();
+  while (1) {
+    pthread_mutex_lock(&upstream->mutex);
+    if (upstream->num_idle == 0) {
+      pthread_mutex_unlock(&upstream->mutex);
+      return -1;
+    }
+    upstream_idle_t idle = upstream->idle[--upstream->num_idle];
+    pthread_mutex_unlock(&upstream->mutex);
+
+    if (now - idle.since < UPSTREAM_IDLE_TIMEOUT && upstream_alive(idle.fd)) {
+      __atomic_add_fetch(&upstream->hits, 1, __ATOMIC_RELAXED);
+      return idle.fd;
+    }
+    __atomic_add_fetch(&upstream->stale, 1, __ATOMIC_RELAXED);
+    close(idle.fd);
+  }
+}
+
+/* Opens a new non-blocking connection to the target. Returns its descriptor,
+ * with *IN_PROGRESS set if the handshake has not finished yet, or -1. */
+int upstream_connect(upstream_t *upstream, int *in_progress) {
+  __atomic_add_fetch(&upstream->misses, 1, __ATOMIC_RELAXED);
+
+  struct sockaddr_in target_address;
+  upstream_address(upstream, &target_address);
+
+  // Create an IPv4 TCP socket to communicate with the proxy target. Pooled
+  // sockets outlive the request, so keep them out of anything exec()ed.
+  int target_fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (target_fd == -1) {
+    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
+  set_nonblocking(target_fd);
+  int nodelay = 1;
+  setsockopt(target_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  // Connect to the proxy target.
+  *in_progress = 0;
+  if (connect(target_fd, (struct sockaddr *) &target_address, sizeof(target_address)) == 0)
+    return target_fd;
+  if (errno == EINPROGRESS) {
+    *in_progress = 1;
+    return target_fd;
+  }
+  close(target_fd);
+  return -1;
+}
+
+/* Puts FD, which has just finished a response, back in the pool. It is closed
+ * instead if the pool is full. */
+void upstream_release(upstream_t *upstream, int fd) {
+  pthread_mutex_lock(&upstream->mutex);
+  if (upstream->num_idle < UPSTREAM_POOL_SIZE) {
+    upstream->idle[upstream->num_idle].fd = fd;
+    upstream->idle[upstream->num_idle].since = upstream_now();
+    upstream->num_idle++;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&upstream->mutex);
+  if (fd >= 0) close(fd);
+}
+
+/* Records that a request had to be resent because its pooled connection
+ * turned out to be closed. */
+void upstream_count_retry(upstream_t *upstream) {
+  __atomic_add_fetch(&upstream->retries, 1, __ATOMIC_RELAXED);
+}
+
+/* Copies UPSTREAM's counters into STATS. */
+void upstream_get_stats(upstream_t *upstream, upstream_stats_t *stats) {
+  stats->hits = __atomic_load_n(&upstream->hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n(&upstream->misses, __ATOMIC_RELAXED);
+  stats->stale = __atomic_load_n(&upstream->stale, __ATOMIC_RELAXED);
+  stats->retries = __atomic_load_n(&upstream->retries, __ATOMIC_RELAXED);
+  stats->dns_refreshes = __atomic_load_n(&upstream->dns_refreshes, __ATOMIC_RELAXED);
+  stats->dns_failures = __atomic_load_n(&upstream->dns_failures, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&upstream->mutex);
+  stats->idle = upstream->num_idle;
+  pthread_mutex_unlock(&upstream->mutex);
+}
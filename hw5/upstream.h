@@ -0,0 +1,58 @@
+#ifndef __UPSTREAM__
+#define __UPSTREAM__
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <time.h>
+
+/* UPSTREAM keeps what the proxy handler needs to reach its target without
+ * paying for a DNS lookup and a TCP handshake on every request: the target's
+ * address, resolved once at startup and refreshed every UPSTREAM_DNS_REFRESH
+ * seconds by a background thread, and a pool of idle keep-alive connections
+ * to it. Connections are handed out most recently used first, and one that
+ * has been idle for UPSTREAM_IDLE_TIMEOUT seconds, or that the target has
+ * closed in the meantime, is dropped instead of reused. */
+
+#define UPSTREAM_POOL_SIZE 64
+#define UPSTREAM_IDLE_TIMEOUT 30
+#define UPSTREAM_DNS_REFRESH 60
+
+typedef struct upstream_idle {
+  int fd;
+  time_t since;
+} upstream_idle_t;
+
+typedef struct upstream_stats {
+  unsigned long hits;        // Requests sent on a pooled connection.
+  unsigned long misses;      // Requests that had to open a new connection.
+  unsigned long stale;       // Pooled connections found closed or expired.
+  unsigned long retries;     // Requests resent after a pooled connection failed.
+  unsigned long dns_refreshes;
+  unsigned long dns_failures;
+  int idle;                  // Connections currently in the pool.
+} upstream_stats_t;
+
+typedef struct upstream {
+  char *hostname;
+  int port;
+  pthread_mutex_t mutex;
+  struct sockaddr_in address;
+  upstream_idle_t idle[UPSTREAM_POOL_SIZE];
+  int num_idle;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long stale;
+  unsigned long retries;
+  unsigned long dns_refreshes;
+  unsigned long dns_failures;
+} upstream_t;
+
+void upstream_init(upstream_t *upstream, char *hostname, int port);
+void upstream_address(upstream_t *upstream, struct sockaddr_in *address);
+int upstream_acquire(upstream_t *upstream);
+int upstream_connect(upstream_t *upstream, int *in_progress);
+void upstream_release(upstream_t *upstream, int fd);
+void upstream_count_retry(upstream_t *upstream);
+void upstream_get_stats(upstream_t *upstream, upstream_stats_t *stats);
+
+#endif
@@ -0,0 +1,173 @@
+#include "uring.h"
+
+#ifdef URING_AVAILABLE
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Setup flags to try, best first. A single thread submits to each ring and
+ * reaps its completions, so the kernel can defer completion work until the
+ * thread asks for events instead of interrupting it; older kernels refuse
+ * these flags. */
+static const unsigned SETUP_FLAGS[] = {
+  IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+  IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+  0,
+};
+
+/*
+ * Sets up RING with room for ENTRIES submissions. Returns -1, with errno
+ * set, if the kernel does not support io_uring or does not allow it. Kernels
+ * before 5.11 are refused too: without IORING_FEAT_EXT_ARG a wait cannot be
+ * given a timeout, and the loops rely on one to run their timers.
+ */
+int uring_init(uring_t *ring, unsigned entries) {
+  memset(ring, 0, sizeof(uring_t));
+
+  struct io_uring_params params;
+  int fd = -1;
+  for (size_t i = 0; i < sizeof(SETUP_FLAGS) / sizeof(SETUP_FLAGS[0]) && fd < 0; i++) {
+    memset(&params, 0, sizeof(params));
+    params.flags = SETUP_FLAGS[i];
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0 && errno != EINVAL) return -1;
+  }
+  if (fd < 0) return -1;
+  ring->fd = ring->enter_fd = fd;
+  ring->setup_flags = params.flags;
+  ring->features = params.features;
+  if (!(ring->features & IORING_FEAT_EXT_ARG)) {
+    errno = EOPNOTSUPP;
+    goto fail;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) goto fail;
+  if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) goto fail;
+  }
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) goto fail;
+
+  char *sq = ring->sq_ring, *cq = ring->cq_ring;
+  ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  /* Submissions are always consumed in order, so slot i of the indirection
+   * array can point at SQE i for good. */
+  unsigned *array = (unsigned *) (sq + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++) array[i] = i;
+
+  /* Registering the ring's own descriptor saves looking it up on every
+   * io_uring_enter(); kernels that cannot do it just skip this. */
+  struct io_uring_rsrc_update update = { .offset = -1U, .data = fd };
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_RING_FDS, &update, 1) == 1) {
+    ring->enter_fd = update.offset;
+    ring->enter_flags |= IORING_ENTER_REGISTERED_RING;
+  }
+  return 0;
+
+fail:;
+  int saved_errno = errno;
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  close(fd);
+  errno = saved_errno;
+  return -1;
+}
+
+/* Submits everything prepared so far and, if WAIT_NR is set, waits until
+ * that many completions are ready or TIMEOUT_MS has passed (-1 for no
+ * limit). */
+static int uring_enter(uring_t *ring, unsigned wait_nr, int timeout_ms) {
+  unsigned submit = ring->sqe_tail - *ring->sq_tail;
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+  unsigned flags = ring->enter_flags | IORING_ENTER_GETEVENTS;
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  void *argp = NULL;
+  size_t argsz = 0;
+  if (wait_nr > 0 && timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (unsigned long) &ts;
+    argp = &arg;
+    argsz = sizeof(arg);
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+
+  int ret = syscall(__NR_io_uring_enter, ring->enter_fd, submit, wait_nr, flags, argp, argsz);
+  if (ret < 0 && (errno == EINTR || errno == ETIME || errno == EBUSY)) ret = 0;
+  return ret;
+}
+
+/* Returns a cleared submission entry, submitting what is queued first if
+ * the queue is full. */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring) {
+  while (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    uring_enter(ring, 0, 0);
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  ring->sqe_tail++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/* Fills in the fields most operations share. */
+void uring_prep(struct io_uring_sqe *sqe, int op, int fd, const void *addr,
+    unsigned len, unsigned long offset, unsigned long user_data) {
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long) addr;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
+
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr, int timeout_ms) {
+  return uring_enter(ring, wait_nr, timeout_ms);
+}
+
+/* Returns the oldest completion not yet seen, or NULL. */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+/* Hands the completion returned by uring_peek_cqe() back to the kernel. */
+void uring_cqe_seen(uring_t *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
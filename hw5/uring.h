@@ -0,0 +1,65 @@
+#ifndef __URING__
+#define __URING__
+
+/* URING is a minimal driver for an io_uring instance, used by the
+ * URINGSERVER. It talks to the kernel through the raw io_uring_setup(2) and
+ * io_uring_enter(2) system calls and the rings they share, so it needs the
+ * kernel's <linux/io_uring.h> but no liburing. URING_AVAILABLE is left
+ * undefined when that header is missing, and the URINGSERVER then builds as
+ * an EPOLLSERVER.
+ *
+ * Submissions are only handed to the kernel by uring_submit_and_wait(), so a
+ * whole batch of them costs a single system call, which also collects the
+ * completions that are ready. */
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define URING_AVAILABLE
+#endif
+#endif
+
+#ifdef URING_AVAILABLE
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+typedef struct uring {
+  int fd;
+  int enter_fd;          // fd, or its index once registered with the ring.
+  unsigned enter_flags;
+  unsigned setup_flags;
+  unsigned features;
+
+  /* Submission queue, shared with the kernel. Entries before sqe_tail have
+   * been handed out; those before *sq_tail have been published. */
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+  unsigned sqe_tail;
+
+  /* Completion queue, shared with the kernel. */
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+} uring_t;
+
+int uring_init(uring_t *ring, unsigned entries);
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+void uring_prep(struct io_uring_sqe *sqe, int op, int fd, const void *addr,
+    unsigned len, unsigned long offset, unsigned long user_data);
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr, int timeout_ms);
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+void uring_cqe_seen(uring_t *ring);
+
+#endif
+
+#endif
@@ -0,0 +1,140 @@
+#include <string.h>
+
+#include "utlist.h"
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+void wheel_init(wheel_t *wheel, long now) {
+  memset(wheel, 0, sizeof(wheel_t));
+  wheel->now = now;
+}
+
+/* Slot index of TICK on LEVEL. */
+static int wheel_index(long tick, int level) {
+  return (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+}
+
+/*
+ * Puts TIMER into its slot: on the lowest level where its deadline and the
+ * current tick only differ in that level's digit and the ones below, so that
+ * the wheel comes round to the slot no later than the deadline. The top level
+ * takes anything less than a full turn of it away. Overdue timers go into
+ * the current slot of level 0, and ones too far off into the last slot of the
+ * top level, from where they are placed again.
+ */
+static void wheel_place(wheel_t *wheel, wheel_timer_t *timer) {
+  long tick = timer->deadline > wheel->now ? timer->deadline : wheel->now;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1
+      && tick >> (WHEEL_BITS * (level + 1)) != wheel->now >> (WHEEL_BITS * (level + 1)))
+    level++;
+  int shift = WHEEL_BITS * level;
+  int index = wheel_index(tick, level);
+  if ((tick >> shift) - (wheel->now >> shift) >= WHEEL_SLOTS)
+    index = (wheel_index(wheel->now, level) - 1) & WHEEL_MASK;
+
+  timer->list = &wheel->slots[level][index];
+  DL_APPEND(*timer->list, timer);
+  wheel->occupied[level] |= 1UL << index;
+}
+
+/* Arms TIMER to expire at DEADLINE, a conn_now_ms() time, first cancelling
+ * it if it is armed already. */
+void wheel_arm(wheel_t *wheel, wheel_timer_t *timer, long deadline) {
+  wheel_cancel(wheel, timer);
+  timer->deadline = deadline;
+  wheel_place(wheel, timer);
+}
+
+/* Disarms TIMER. Does nothing if it is not armed. */
+void wheel_cancel(wheel_t *wheel, wheel_timer_t *timer) {
+  if (timer->list == NULL) return;
+  DL_DELETE(*timer->list, timer);
+  if (*timer->list == NULL && timer->list != &wheel->due) {
+    long slot = timer->list - &wheel->slots[0][0];
+    wheel->occupied[slot / WHEEL_SLOTS] &= ~(1UL << (slot % WHEEL_SLOTS));
+  }
+  timer->list = NULL;
+}
+
+/* Empties slot INDEX of LEVEL, returning its timers. */
+static wheel_timer_t *wheel_take(wheel_t *wheel, int level, int index) {
+  wheel_timer_t *timers = wheel->slots[level][index];
+  wheel->slots[level][index] = NULL;
+  wheel->occupied[level] &= ~(1UL << index);
+  return timers;
+}
+
+static int wheel_empty(wheel_t *wheel) {
+  for (int level = 0; level < WHEEL_LEVELS; level++)
+    if (wheel->occupied[level]) return 0;
+  return 1;
+}
+
+/*
+ * Returns a timer whose deadline is at or before NOW, disarmed, or NULL once
+ * there are none. Callers take timers until NULL, and may arm and cancel
+ * timers in between.
+ */
+wheel_timer_t *wheel_expire(wheel_t *wheel, long now) {
+  while (wheel->due == NULL && wheel->now <= now) {
+    if (wheel_empty(wheel)) {
+      wheel->now = now + 1;
+      break;
+    }
+
+    /* Coming round to a slot on a level moves its timers down. */
+    long tick = wheel->now;
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+      if (tick & ((1L << (WHEEL_BITS * level)) - 1)) break;
+      wheel_timer_t *timer, *tmp;
+      wheel_timer_t *timers = wheel_take(wheel, level, wheel_index(tick, level));
+      DL_FOREACH_SAFE(timers, timer, tmp)
+        wheel_place(wheel, timer);
+    }
+
+    wheel_timer_t *timer, *tmp;
+    wheel_timer_t *timers = wheel_take(wheel, 0, wheel_index(tick, 0));
+    DL_FOREACH_SAFE(timers, timer, tmp) {
+      timer->list = &wheel->due;
+      DL_APPEND(wheel->due, timer);
+    }
+    wheel->now++;
+  }
+
+  wheel_timer_t *timer = wheel->due;
+  if (timer != NULL) {
+    DL_DELETE(wheel->due, timer);
+    timer->list = NULL;
+  }
+  return timer;
+}
+
+/* Index of the first slot in use at or after slot FROM of LEVEL, counting
+ * round, as an offset from FROM; -1 if there is none. */
+static int wheel_next_slot(wheel_t *wheel, int level, int from) {
+  unsigned long occupied = wheel->occupied[level];
+  if (occupied == 0) return -1;
+  unsigned long rotated = from ? occupied >> from | occupied << (WHEEL_SLOTS - from) : occupied;
+  return __builtin_ctzl(rotated);
+}
+
+/*
+ * Returns how many milliseconds from NOW the loop may sleep before it has
+ * to call wheel_expire() again, or -1 if no timer is armed. This is the next
+ * deadline on level 0, or else when the wheel comes round to the next slot
+ * in use on a level above.
+ */
+int wheel_timeout(wheel_t *wheel, long now) {
+  if (wheel->due != NULL) return 0;
+  for (int level = 0; level < WHEEL_LEVELS; level++) {
+    int from = wheel_index(wheel->now, level);
+    int offset = wheel_next_slot(wheel, level, from);
+    if (offset < 0) continue;
+    long tick = level == 0 ? wheel->now + offset
+        : ((wheel->now >> (WHEEL_BITS * level)) + offset) << (WHEEL_BITS * level);
+    return tick > now ? (int) (tick - now) : 0;
+  }
+  return -1;
+}
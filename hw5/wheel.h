@@ -0,0 +1,45 @@
+#ifndef __WHEEL__
+#define __WHEEL__
+
+/* WHEEL is a hierarchical timing wheel, which the event loops use for the
+ * timeouts of their connections. Time is counted in ticks of a millisecond.
+ * Level 0 has a slot for each of the next WHEEL_SLOTS ticks; each level above
+ * has slots WHEEL_SLOTS times as wide, so that four levels cover about four
+ * and a half hours (later deadlines are clamped to that). A timer is kept in
+ * the slot its deadline falls in, on the lowest level that reaches that far,
+ * and moves down a level whenever the wheel below it comes round to its slot.
+ *
+ * Arming and cancelling a timer are O(1) list operations, and a bitmap of the
+ * slots in use on each level finds the next deadline without scanning, so the
+ * loops can sleep until it instead of waking every tick. Timers are embedded
+ * in what they time and carry no callbacks: wheel_expire() hands back the
+ * ones that are due.
+ *
+ * A wheel belongs to a single event loop and takes no locks. */
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+typedef struct wheel_timer {
+  long deadline;             // conn_now_ms() time.
+  void *data;
+  struct wheel_timer **list; // Slot (or due list) holding the timer; NULL if not armed.
+  struct wheel_timer *next;
+  struct wheel_timer *prev;
+} wheel_timer_t;
+
+typedef struct wheel {
+  long now; // Next tick to expire; every one before it has been.
+  unsigned long occupied[WHEEL_LEVELS]; // Bit i is set if slot i is in use.
+  wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+  wheel_timer_t *due; // Expired, and not yet handed back by wheel_expire().
+} wheel_t;
+
+void wheel_init(wheel_t *wheel, long now);
+void wheel_arm(wheel_t *wheel, wheel_timer_t *timer, long deadline);
+void wheel_cancel(wheel_t *wheel, wheel_timer_t *timer);
+wheel_timer_t *wheel_expire(wheel_t *wheel, long now);
+int wheel_timeout(wheel_t *wheel, long now);
+
+#endif
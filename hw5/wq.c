@@ -1,38 +1,299 @@
+#include <errno.h>
 #include <stdlib.h>
+#include <time.h>
 #include "wq.h"
+
+/* Microseconds on a monotonic clock. */
+static long wq_now_us(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+#ifdef WQ_RING
+
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Number of times an idle worker polls the ring before going to sleep. */
+#define WQ_SPIN 200
+
+static void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+/* Sleeps while *FUTEX is VALUE, for at most TIMEOUT (NULL for no limit). */
+static void futex_wait(int *futex, int value, const struct timespec *timeout) {
+  syscall(SYS_futex, futex, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void futex_wake(int *futex, int count) {
+  syscall(SYS_futex, futex, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/* Initializes a work queue WQ. */
+void wq_init(wq_t *wq) {
+  wq->cells = calloc(WQ_CAPACITY, sizeof(wq_cell_t));
+  if (wq->cells == NULL) {
+    perror("Failed to allocate work queue");
+    exit(1);
+  }
+  for (unsigned long i = 0; i < WQ_CAPACITY; i++)
+    wq->cells[i].sequence = i;
+  wq->mask = WQ_CAPACITY - 1;
+  wq->head = 0;
+  wq->tail = 0;
+  wq->futex = 0;
+  wq->waiters = 0;
+  wq->limit = 0;
+  wq->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? WQ_SPIN : 0;
+}
+
+/*
+ * Each cell's sequence number says whose turn it is: a cell at position POS
+ * is free for the pusher of POS when sequence == POS, and holds an item for
+ * the popper of POS when sequence == POS + 1. Popping hands the cell on to the
+ * pusher one lap later by setting sequence to POS + WQ_CAPACITY.
+ */
+static int wq_try_push(wq_t *wq, int client_socket_fd, long pushed_us) {
+  unsigned long pos = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+  while (1) {
+    wq_cell_t *cell = &wq->cells[pos & wq->mask];
+    unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    long diff = (long) (sequence - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&wq->tail, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->client_socket_fd = client_socket_fd;
+        cell->pushed_us = pushed_us;
+        __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (diff < 0) {
+      return 0; // Full.
+    } else {
+      pos = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static int wq_try_pop(wq_t *wq, int *client_socket_fd, long *pushed_us) {
+  unsigned long pos = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+  while (1) {
+    wq_cell_t *cell = &wq->cells[pos & wq->mask];
+    unsigned long sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    long diff = (long) (sequence - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&wq->head, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *client_socket_fd = cell->client_socket_fd;
+        *pushed_us = cell->pushed_us;
+        __atomic_store_n(&cell->sequence, pos + wq->mask + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (diff < 0) {
+      return 0; // Empty.
+    } else {
+      pos = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Remove an item from the WQ. This function should block until there is at
+ * least one item on the queue, or until TIMEOUT_MS has passed (-1 for no
+ * limit), in which case it returns -1. If WAITED_US is given, it is set to
+ * how long the item spent in the queue. */
+int wq_pop_within(wq_t *wq, long timeout_ms, long *waited_us) {
+  int client_socket_fd;
+  long pushed_us;
+  long deadline_us = timeout_ms >= 0 ? wq_now_us() + timeout_ms * 1000 : 0;
+  while (1) {
+    for (int i = 0; i < wq->spin; i++) {
+      if (wq_try_pop(wq, &client_socket_fd, &pushed_us)) goto popped;
+      cpu_relax();
+    }
+
+    /* Announce ourselves before the final check, so that a push which
+     * lands after it either sees a waiter to wake or changes the futex
+     * word and makes futex_wait() return straight away. */
+    int futex = __atomic_load_n(&wq->futex, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&wq->waiters, 1, __ATOMIC_SEQ_CST);
+    if (wq_try_pop(wq, &client_socket_fd, &pushed_us)) {
+      __atomic_sub_fetch(&wq->waiters, 1, __ATOMIC_SEQ_CST);
+      goto popped;
+    }
+    struct timespec timeout, *timeoutp = NULL;
+    if (timeout_ms >= 0) {
+      long remaining_us = deadline_us - wq_now_us();
+      if (remaining_us <= 0) {
+        __atomic_sub_fetch(&wq->waiters, 1, __ATOMIC_SEQ_CST);
+        return -1;
+      }
+      timeout.tv_sec = remaining_us / 1000000;
+      timeout.tv_nsec = remaining_us % 1000000 * 1000;
+      timeoutp = &timeout;
+    }
+    futex_wait(&wq->futex, futex, timeoutp);
+    __atomic_sub_fetch(&wq->waiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+popped:
+  if (waited_us != NULL) *waited_us = wq_now_us() - pushed_us;
+  return client_socket_fd;
+}
+
+/* Number of items in WQ. Only a snapshot, since other threads keep pushing
+ * and popping. */
+long wq_size(wq_t *wq) {
+  unsigned long head = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+  unsigned long tail = __atomic_load_n(&wq->tail, __ATOMIC_RELAXED);
+  return tail > head ? (long) (tail - head) : 0;
+}
+
+/* How long the oldest item in WQ has been waiting, or 0 if there is none. The
+ * cell is read without claiming it, so this is only a snapshot as well. */
+long wq_oldest_wait(wq_t *wq) {
+  unsigned long head = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+  wq_cell_t *cell = &wq->cells[head & wq->mask];
+  if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != head + 1) return 0;
+  long pushed_us = __atomic_load_n(&cell->pushed_us, __ATOMIC_RELAXED);
+  return pushed_us > 0 ? wq_now_us() - pushed_us : 0;
+}
+
+/* Wakes a worker, if any is asleep, after a push. */
+static void wq_wake(wq_t *wq) {
+  __atomic_add_fetch(&wq->futex, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&wq->waiters, __ATOMIC_SEQ_CST) > 0)
+    futex_wake(&wq->futex, 1);
+}
+
+/* Add ITEM to WQ. If the ring is full, waits for a worker to make room. */
+void wq_push(wq_t *wq, int client_socket_fd) {
+  long pushed_us = wq_now_us();
+  while (!wq_try_push(wq, client_socket_fd, pushed_us))
+    sched_yield();
+  wq_wake(wq);
+}
+
+/* Add ITEM to WQ unless it holds wq->limit items already or the ring is
+ * full. Returns whether it was added. */
+int wq_offer(wq_t *wq, int client_socket_fd) {
+  if (wq->limit > 0 && wq_size(wq) >= wq->limit) return 0;
+  if (!wq_try_push(wq, client_socket_fd, wq_now_us())) return 0;
+  wq_wake(wq);
+  return 1;
+}
+
+#else
+
 #include "utlist.h"
 
 /* Initializes a work queue WQ. */
 void wq_init(wq_t *wq) {
   pthread_mutex_init(&wq->mutex, NULL);
-  pthread_cond_init(&wq->condvar, NULL);
+  /* Timed pops wait against the monotonic clock, like the rest of the
+   * server's timeouts. */
+  pthread_condattr_t condattr;
+  pthread_condattr_init(&condattr);
+  pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wq->condvar, &condattr);
+  pthread_condattr_destroy(&condattr);
   wq->size = 0;
+  wq->limit = 0;
   wq->head = NULL;
 }
 
-/* Remove an item from the WQ. This function should block until there
- * is at least one item on the queue. */
-int wq_pop(wq_t *wq) {
+/* Remove an item from the WQ. This function should block until there is at
+ * least one item on the queue, or until TIMEOUT_MS has passed (-1 for no
+ * limit), in which case it returns -1. If WAITED_US is given, it is set to
+ * how long the item spent in the queue. */
+int wq_pop_within(wq_t *wq, long timeout_ms, long *waited_us) {
+  struct timespec deadline;
+  if (timeout_ms >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += timeout_ms % 1000 * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+
   pthread_mutex_lock(&wq->mutex);
-  while (wq->size == 0)
-    pthread_cond_wait(&wq->condvar, &wq->mutex);
+  while (wq->size == 0) {
+    if (timeout_ms < 0) {
+      pthread_cond_wait(&wq->condvar, &wq->mutex);
+    } else if (pthread_cond_timedwait(&wq->condvar, &wq->mutex, &deadline) == ETIMEDOUT
+        && wq->size == 0) {
+      pthread_mutex_unlock(&wq->mutex);
+      return -1;
+    }
+  }
   wq_item_t *wq_item = wq->head;
   int client_socket_fd = wq->head->client_socket_fd;
-  wq->size--;
+  __atomic_store_n(&wq->size, wq->size - 1, __ATOMIC_RELAXED);
   DL_DELETE(wq->head, wq->head);
 
   pthread_mutex_unlock(&wq->mutex);
+  if (waited_us != NULL) *waited_us = wq_now_us() - wq_item->pushed_us;
   free(wq_item);
   return client_socket_fd;
 }
 
-/* Add ITEM to WQ. */
-void wq_push(wq_t *wq, int client_socket_fd) {
+/* Number of items in WQ. Only a snapshot, read without the lock. */
+long wq_size(wq_t *wq) {
+  return __atomic_load_n(&wq->size, __ATOMIC_RELAXED);
+}
+
+/* How long the oldest item in WQ has been waiting, or 0 if there is none. */
+long wq_oldest_wait(wq_t *wq) {
   pthread_mutex_lock(&wq->mutex);
+  long pushed_us = wq->head != NULL ? wq->head->pushed_us : 0;
+  pthread_mutex_unlock(&wq->mutex);
+  return pushed_us > 0 ? wq_now_us() - pushed_us : 0;
+}
+
+/* Appends ITEM to WQ, which must be locked. */
+static void wq_append(wq_t *wq, int client_socket_fd) {
   wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
   wq_item->client_socket_fd = client_socket_fd;
+  wq_item->pushed_us = wq_now_us();
   DL_APPEND(wq->head, wq_item);
-  wq->size++;
+  __atomic_store_n(&wq->size, wq->size + 1, __ATOMIC_RELAXED);
   pthread_cond_broadcast(&wq->condvar);
+}
+
+/* Add ITEM to WQ. */
+void wq_push(wq_t *wq, int client_socket_fd) {
+  pthread_mutex_lock(&wq->mutex);
+  wq_append(wq, client_socket_fd);
   pthread_mutex_unlock(&wq->mutex);
 }
+
+/* Add ITEM to WQ unless it holds wq->limit items already. Returns whether it
+ * was added. */
+int wq_offer(wq_t *wq, int client_socket_fd) {
+  pthread_mutex_lock(&wq->mutex);
+  int added = wq->limit == 0 || wq->size < wq->limit;
+  if (added) wq_append(wq, client_socket_fd);
+  pthread_mutex_unlock(&wq->mutex);
+  return added;
+}
+
+#endif
+
+/* Remove an item from the WQ, blocking until there is one. If WAITED_US is
+ * given, it is set to how long the item spent in the queue. */
+int wq_pop_timed(wq_t *wq, long *waited_us) {
+  return wq_pop_within(wq, -1, waited_us);
+}
+
+/* Remove an item from the WQ, blocking until there is one. */
+int wq_pop(wq_t *wq) {
+  return wq_pop_timed(wq, NULL);
+}
@@ -4,24 +4,71 @@
 #include <pthread.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served.
+ *
+ * By default it is a linked list guarded by a mutex and condition variable.
+ * Building with -D WQ_RING swaps in a fixed-capacity lock-free ring instead,
+ * behind the same wq_init/wq_push/wq_pop API: pushes and pops claim slots with
+ * a single compare-and-swap, idle workers spin briefly and then sleep on a
+ * futex, and each push wakes at most one of them.
+ *
+ * Either way every item records when it was pushed, so that wq_pop_timed()
+ * can tell how long it waited, and wq_oldest_wait() how long the head of the
+ * queue has been waiting so far. wq_pop_within() gives up after a timeout,
+ * for workers that exit when idle. wq_offer() is a push that refuses instead
+ * of queueing past LIMIT items (or the ring's capacity), so that the caller
+ * can turn the client away while that is still cheap. */
+
+#ifdef WQ_RING
+
+#define WQ_CAPACITY 4096 // Must be a power of two.
+#define WQ_CACHE_LINE 64
+
+typedef struct wq_cell {
+  unsigned long sequence;
+  int client_socket_fd;
+  long pushed_us;
+} wq_cell_t;
+
+/* head and tail are written by different threads, so each gets its own cache
+ * line to avoid false sharing. */
+typedef struct wq {
+  wq_cell_t *cells;
+  unsigned long mask;
+  unsigned long head __attribute__((aligned(WQ_CACHE_LINE))); // Next slot to pop.
+  unsigned long tail __attribute__((aligned(WQ_CACHE_LINE))); // Next slot to push.
+  int futex __attribute__((aligned(WQ_CACHE_LINE)));          // Bumped on every push.
+  int waiters;
+  int spin; // Polls before sleeping; 0 on a single CPU, where spinning only delays the pusher.
+  long limit; // Most items wq_offer() queues; 0 for the ring's capacity.
+} wq_t;
+
+#else
 
 typedef struct wq_item {
   int client_socket_fd; // Client socket to be served.
+  long pushed_us;       // When it was pushed.
   struct wq_item *next;
   struct wq_item *prev;
 } wq_item_t;
 
 typedef struct wq {
   int size;
+  long limit; // Most items wq_offer() queues; 0 for no limit.
   wq_item_t *head;
   pthread_mutex_t mutex;
   pthread_cond_t condvar;
-  /* TODO: More stuff here, maybe? */
 } wq_t;
 
+#endif
+
 void wq_init(wq_t *wq);
 void wq_push(wq_t *wq, int client_socket_fd);
+int wq_offer(wq_t *wq, int client_socket_fd);
 int wq_pop(wq_t *wq);
+int wq_pop_timed(wq_t *wq, long *waited_us);
+int wq_pop_within(wq_t *wq, long timeout_ms, long *waited_us);
+long wq_size(wq_t *wq);
+long wq_oldest_wait(wq_t *wq);
 
 #endif